@@ -0,0 +1,244 @@
+unsigned const char shaders_bug_vert[] = {
+  0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x33, 0x33, 0x30,
+  0x20, 0x63, 0x6f, 0x72, 0x65, 0x0a, 0x0a, 0x2f, 0x2f, 0x20, 0x4f, 0x6e,
+  0x65, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x20, 0x70,
+  0x65, 0x72, 0x20, 0x62, 0x75, 0x67, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20,
+  0x62, 0x75, 0x67, 0x20, 0x69, 0x73, 0x20, 0x62, 0x75, 0x69, 0x6c, 0x74,
+  0x20, 0x68, 0x65, 0x72, 0x65, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x39,
+  0x20, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x74, 0x72, 0x61, 0x70, 0x65, 0x7a,
+  0x6f, 0x69, 0x64, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x36, 0x0a, 0x2f, 0x2f,
+  0x20, 0x76, 0x65, 0x72, 0x74, 0x69, 0x63, 0x65, 0x73, 0x20, 0x65, 0x61,
+  0x63, 0x68, 0x3a, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x6f, 0x64, 0x79,
+  0x2c, 0x20, 0x32, 0x20, 0x61, 0x6e, 0x74, 0x65, 0x6e, 0x6e, 0x61, 0x65,
+  0x20, 0x61, 0x6e, 0x64, 0x20, 0x36, 0x20, 0x6c, 0x65, 0x67, 0x73, 0x2c,
+  0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x6f, 0x72, 0x64,
+  0x65, 0x72, 0x2e, 0x20, 0x44, 0x72, 0x61, 0x77, 0x69, 0x6e, 0x67, 0x0a,
+  0x2f, 0x2f, 0x20, 0x66, 0x65, 0x77, 0x65, 0x72, 0x20, 0x76, 0x65, 0x72,
+  0x74, 0x69, 0x63, 0x65, 0x73, 0x20, 0x6c, 0x65, 0x61, 0x76, 0x65, 0x73,
+  0x20, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 0x61, 0x73,
+  0x74, 0x20, 0x70, 0x61, 0x72, 0x74, 0x73, 0x2c, 0x20, 0x77, 0x68, 0x69,
+  0x63, 0x68, 0x20, 0x69, 0x73, 0x20, 0x68, 0x6f, 0x77, 0x20, 0x74, 0x68,
+  0x65, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 0x6f, 0x66, 0x20, 0x64,
+  0x65, 0x74, 0x61, 0x69, 0x6c, 0x0a, 0x2f, 0x2f, 0x20, 0x69, 0x73, 0x20,
+  0x70, 0x69, 0x63, 0x6b, 0x65, 0x64, 0x2e, 0x0a, 0x6c, 0x61, 0x79, 0x6f,
+  0x75, 0x74, 0x20, 0x28, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e,
+  0x20, 0x3d, 0x20, 0x30, 0x29, 0x20, 0x69, 0x6e, 0x20, 0x76, 0x65, 0x63,
+  0x34, 0x20, 0x69, 0x5f, 0x70, 0x6f, 0x73, 0x4f, 0x72, 0x69, 0x65, 0x6e,
+  0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x3b, 0x0a, 0x6c, 0x61, 0x79, 0x6f,
+  0x75, 0x74, 0x20, 0x28, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e,
+  0x20, 0x3d, 0x20, 0x31, 0x29, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 0x6f,
+  0x61, 0x74, 0x20, 0x69, 0x5f, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a,
+  0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x20, 0x28, 0x6c, 0x6f, 0x63, 0x61,
+  0x74, 0x69, 0x6f, 0x6e, 0x20, 0x3d, 0x20, 0x32, 0x29, 0x20, 0x69, 0x6e,
+  0x20, 0x75, 0x69, 0x6e, 0x74, 0x20, 0x69, 0x5f, 0x63, 0x6f, 0x6c, 0x6f,
+  0x72, 0x49, 0x6e, 0x64, 0x65, 0x78, 0x3b, 0x0a, 0x6c, 0x61, 0x79, 0x6f,
+  0x75, 0x74, 0x20, 0x28, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e,
+  0x20, 0x3d, 0x20, 0x33, 0x29, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 0x6f,
+  0x61, 0x74, 0x20, 0x69, 0x5f, 0x6c, 0x65, 0x67, 0x50, 0x68, 0x61, 0x73,
+  0x65, 0x3b, 0x0a, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20,
+  0x6d, 0x61, 0x74, 0x34, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x66, 0x6f,
+  0x72, 0x6d, 0x3b, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20,
+  0x76, 0x65, 0x63, 0x33, 0x20, 0x6c, 0x6f, 0x6f, 0x70, 0x43, 0x6f, 0x6c,
+  0x6f, 0x72, 0x73, 0x5b, 0x38, 0x5d, 0x3b, 0x0a, 0x75, 0x6e, 0x69, 0x66,
+  0x6f, 0x72, 0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x74, 0x69,
+  0x6d, 0x65, 0x3b, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20,
+  0x69, 0x6e, 0x74, 0x20, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x4d, 0x6f, 0x64,
+  0x65, 0x3b, 0x0a, 0x0a, 0x6f, 0x75, 0x74, 0x20, 0x76, 0x65, 0x63, 0x33,
+  0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0a, 0x6f, 0x75, 0x74, 0x20,
+  0x76, 0x65, 0x63, 0x33, 0x20, 0x6e, 0x6f, 0x72, 0x6d, 0x61, 0x6c, 0x3b,
+  0x0a, 0x0a, 0x2f, 0x2f, 0x20, 0x53, 0x61, 0x6d, 0x65, 0x20, 0x63, 0x6f,
+  0x72, 0x6e, 0x65, 0x72, 0x20, 0x6f, 0x72, 0x64, 0x65, 0x72, 0x20, 0x61,
+  0x73, 0x20, 0x50, 0x75, 0x73, 0x68, 0x54, 0x72, 0x61, 0x70, 0x65, 0x7a,
+  0x6f, 0x69, 0x64, 0x0a, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x69, 0x6e,
+  0x74, 0x20, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x45, 0x6e, 0x64, 0x5b,
+  0x36, 0x5d, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x74, 0x5b, 0x36, 0x5d, 0x28,
+  0x30, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x31, 0x2c, 0x20, 0x31, 0x2c, 0x20,
+  0x31, 0x2c, 0x20, 0x30, 0x29, 0x3b, 0x0a, 0x63, 0x6f, 0x6e, 0x73, 0x74,
+  0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x6f, 0x72, 0x6e, 0x65,
+  0x72, 0x53, 0x69, 0x64, 0x65, 0x5b, 0x36, 0x5d, 0x20, 0x3d, 0x20, 0x66,
+  0x6c, 0x6f, 0x61, 0x74, 0x5b, 0x36, 0x5d, 0x28, 0x2d, 0x31, 0x2e, 0x30,
+  0x2c, 0x20, 0x31, 0x2e, 0x30, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x2c, 0x20,
+  0x31, 0x2e, 0x30, 0x2c, 0x20, 0x2d, 0x31, 0x2e, 0x30, 0x2c, 0x20, 0x2d,
+  0x31, 0x2e, 0x30, 0x29, 0x3b, 0x0a, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20,
+  0x6d, 0x61, 0x69, 0x6e, 0x28, 0x29, 0x0a, 0x7b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x69, 0x6e, 0x74, 0x20, 0x70, 0x61, 0x72, 0x74, 0x20, 0x3d, 0x20,
+  0x67, 0x6c, 0x5f, 0x56, 0x65, 0x72, 0x74, 0x65, 0x78, 0x49, 0x44, 0x2f,
+  0x36, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x63,
+  0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x67, 0x6c, 0x5f, 0x56,
+  0x65, 0x72, 0x74, 0x65, 0x78, 0x49, 0x44, 0x25, 0x36, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x70, 0x6f, 0x73, 0x20,
+  0x3d, 0x20, 0x69, 0x5f, 0x70, 0x6f, 0x73, 0x4f, 0x72, 0x69, 0x65, 0x6e,
+  0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2e, 0x78, 0x79, 0x7a, 0x3b, 0x0a,
+  0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x20,
+  0x3d, 0x20, 0x73, 0x69, 0x6e, 0x28, 0x69, 0x5f, 0x70, 0x6f, 0x73, 0x4f,
+  0x72, 0x69, 0x65, 0x6e, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2e, 0x77,
+  0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74,
+  0x20, 0x73, 0x20, 0x3d, 0x20, 0x63, 0x6f, 0x73, 0x28, 0x69, 0x5f, 0x70,
+  0x6f, 0x73, 0x4f, 0x72, 0x69, 0x65, 0x6e, 0x74, 0x61, 0x74, 0x69, 0x6f,
+  0x6e, 0x2e, 0x77, 0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c,
+  0x6f, 0x61, 0x74, 0x20, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x20, 0x3d, 0x20,
+  0x69, 0x5f, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x64, 0x69, 0x72, 0x65, 0x63, 0x74,
+  0x69, 0x6f, 0x6e, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x63,
+  0x2c, 0x20, 0x73, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x29, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x62, 0x6f, 0x64, 0x79,
+  0x54, 0x6f, 0x20, 0x3d, 0x20, 0x70, 0x6f, 0x73, 0x20, 0x2b, 0x20, 0x64,
+  0x69, 0x72, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x2a, 0x73, 0x63, 0x61,
+  0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61,
+  0x74, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x57, 0x69, 0x64, 0x74, 0x68, 0x20,
+  0x3d, 0x20, 0x30, 0x2e, 0x30, 0x36, 0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65,
+  0x3b, 0x0a, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20,
+  0x66, 0x72, 0x6f, 0x6d, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65,
+  0x63, 0x33, 0x20, 0x74, 0x6f, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66,
+  0x6c, 0x6f, 0x61, 0x74, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x57, 0x69, 0x64,
+  0x74, 0x68, 0x20, 0x3d, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x57, 0x69, 0x64,
+  0x74, 0x68, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61,
+  0x74, 0x20, 0x74, 0x6f, 0x57, 0x69, 0x64, 0x74, 0x68, 0x20, 0x3d, 0x20,
+  0x6c, 0x69, 0x6e, 0x65, 0x57, 0x69, 0x64, 0x74, 0x68, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x6e, 0x20, 0x3d, 0x20,
+  0x76, 0x65, 0x63, 0x33, 0x28, 0x30, 0x2e, 0x30, 0x2c, 0x20, 0x30, 0x2e,
+  0x30, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x69, 0x66, 0x28, 0x70, 0x61, 0x72, 0x74, 0x3d, 0x3d, 0x30, 0x29,
+  0x0a, 0x20, 0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x69, 0x66, 0x28, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x4d,
+  0x6f, 0x64, 0x65, 0x21, 0x3d, 0x30, 0x29, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x3d,
+  0x20, 0x70, 0x6f, 0x73, 0x20, 0x2d, 0x20, 0x64, 0x69, 0x72, 0x65, 0x63,
+  0x74, 0x69, 0x6f, 0x6e, 0x2a, 0x30, 0x2e, 0x34, 0x2a, 0x73, 0x63, 0x61,
+  0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x74, 0x6f, 0x20, 0x3d, 0x20, 0x70, 0x6f, 0x73,
+  0x20, 0x2b, 0x20, 0x64, 0x69, 0x72, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e,
+  0x2a, 0x30, 0x2e, 0x34, 0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x66, 0x72, 0x6f, 0x6d, 0x57, 0x69, 0x64, 0x74, 0x68, 0x20, 0x3d, 0x20,
+  0x30, 0x2e, 0x38, 0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74,
+  0x6f, 0x57, 0x69, 0x64, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x30, 0x2e, 0x38,
+  0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x3d, 0x20,
+  0x70, 0x6f, 0x73, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x6f, 0x20, 0x3d, 0x20, 0x62, 0x6f,
+  0x64, 0x79, 0x54, 0x6f, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x57, 0x69,
+  0x64, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x30, 0x2e, 0x37, 0x2a, 0x73, 0x63,
+  0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x6f, 0x57, 0x69, 0x64, 0x74, 0x68,
+  0x20, 0x3d, 0x20, 0x30, 0x2e, 0x33, 0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65,
+  0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a,
+  0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c,
+  0x73, 0x65, 0x20, 0x69, 0x66, 0x28, 0x70, 0x61, 0x72, 0x74, 0x20, 0x3c,
+  0x20, 0x33, 0x29, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20,
+  0x61, 0x6e, 0x74, 0x65, 0x6e, 0x6e, 0x61, 0x54, 0x68, 0x65, 0x74, 0x61,
+  0x20, 0x3d, 0x20, 0x74, 0x69, 0x6d, 0x65, 0x2a, 0x36, 0x2e, 0x30, 0x3b,
+  0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f,
+  0x61, 0x74, 0x20, 0x61, 0x6e, 0x74, 0x43, 0x6f, 0x73, 0x20, 0x3d, 0x20,
+  0x63, 0x6f, 0x73, 0x28, 0x61, 0x6e, 0x74, 0x65, 0x6e, 0x6e, 0x61, 0x54,
+  0x68, 0x65, 0x74, 0x61, 0x29, 0x2a, 0x30, 0x2e, 0x33, 0x2a, 0x73, 0x63,
+  0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x61, 0x6e, 0x74, 0x53, 0x69,
+  0x6e, 0x20, 0x3d, 0x20, 0x73, 0x69, 0x6e, 0x28, 0x61, 0x6e, 0x74, 0x65,
+  0x6e, 0x6e, 0x61, 0x54, 0x68, 0x65, 0x74, 0x61, 0x29, 0x2a, 0x30, 0x2e,
+  0x33, 0x2a, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x3d, 0x20,
+  0x62, 0x6f, 0x64, 0x79, 0x54, 0x6f, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x28, 0x70, 0x61, 0x72, 0x74, 0x3d,
+  0x3d, 0x31, 0x29, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x7b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x74, 0x6f, 0x20, 0x3d, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x54,
+  0x6f, 0x20, 0x2b, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x2d, 0x73, 0x63,
+  0x61, 0x6c, 0x65, 0x2a, 0x73, 0x2a, 0x30, 0x2e, 0x35, 0x20, 0x2b, 0x20,
+  0x61, 0x6e, 0x74, 0x43, 0x6f, 0x73, 0x2c, 0x20, 0x73, 0x63, 0x61, 0x6c,
+  0x65, 0x2a, 0x63, 0x2a, 0x30, 0x2e, 0x35, 0x20, 0x2b, 0x20, 0x61, 0x6e,
+  0x74, 0x53, 0x69, 0x6e, 0x2c, 0x20, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x29,
+  0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65,
+  0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74,
+  0x6f, 0x20, 0x3d, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x54, 0x6f, 0x20, 0x2b,
+  0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x2a,
+  0x73, 0x2a, 0x30, 0x2e, 0x35, 0x20, 0x2d, 0x20, 0x61, 0x6e, 0x74, 0x53,
+  0x69, 0x6e, 0x2c, 0x20, 0x2d, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x2a, 0x63,
+  0x2a, 0x30, 0x2e, 0x35, 0x20, 0x2b, 0x20, 0x61, 0x6e, 0x74, 0x43, 0x6f,
+  0x73, 0x2c, 0x20, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x29, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x64, 0x69, 0x72,
+  0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x7d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x2f, 0x2f, 0x20, 0x46, 0x65, 0x65, 0x74, 0x20, 0x73, 0x74, 0x61,
+  0x79, 0x20, 0x70, 0x6c, 0x61, 0x6e, 0x74, 0x65, 0x64, 0x20, 0x77, 0x68,
+  0x69, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x6f, 0x64, 0x79,
+  0x20, 0x6d, 0x6f, 0x76, 0x65, 0x73, 0x20, 0x61, 0x20, 0x73, 0x74, 0x65,
+  0x70, 0x20, 0x66, 0x6f, 0x72, 0x77, 0x61, 0x72, 0x64, 0x20, 0x61, 0x6e,
+  0x64, 0x20, 0x74, 0x68, 0x65, 0x6e, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x20, 0x61,
+  0x68, 0x65, 0x61, 0x64, 0x2e, 0x20, 0x4e, 0x65, 0x69, 0x67, 0x68, 0x62,
+  0x6f, 0x75, 0x72, 0x69, 0x6e, 0x67, 0x20, 0x6c, 0x65, 0x67, 0x73, 0x20,
+  0x73, 0x74, 0x65, 0x70, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x75, 0x72, 0x6e,
+  0x73, 0x2e, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69,
+  0x6e, 0x74, 0x20, 0x6c, 0x65, 0x67, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72,
+  0x74, 0x2d, 0x33, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x69, 0x6e, 0x74, 0x20, 0x70, 0x61, 0x69, 0x72, 0x20, 0x3d, 0x20,
+  0x6c, 0x65, 0x67, 0x2f, 0x32, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x73, 0x69, 0x64,
+  0x65, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x65, 0x67, 0x20, 0x26, 0x20, 0x31,
+  0x29, 0x3d, 0x3d, 0x30, 0x20, 0x3f, 0x20, 0x31, 0x2e, 0x30, 0x20, 0x3a,
+  0x20, 0x2d, 0x31, 0x2e, 0x30, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x3d, 0x20, 0x6d, 0x69,
+  0x78, 0x28, 0x70, 0x6f, 0x73, 0x2c, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x54,
+  0x6f, 0x2c, 0x20, 0x30, 0x2e, 0x35, 0x2a, 0x66, 0x6c, 0x6f, 0x61, 0x74,
+  0x28, 0x70, 0x61, 0x69, 0x72, 0x29, 0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x65,
+  0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x6d, 0x69, 0x78, 0x28, 0x70,
+  0x6f, 0x73, 0x2c, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x54, 0x6f, 0x2c, 0x20,
+  0x30, 0x2e, 0x35, 0x2a, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x28, 0x70, 0x61,
+  0x69, 0x72, 0x29, 0x20, 0x2b, 0x20, 0x30, 0x2e, 0x35, 0x29, 0x3b, 0x0a,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x65, 0x6e, 0x74,
+  0x65, 0x72, 0x2e, 0x7a, 0x20, 0x3d, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x2e,
+  0x7a, 0x20, 0x2d, 0x20, 0x31, 0x2e, 0x30, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x73,
+  0x74, 0x65, 0x70, 0x20, 0x3d, 0x20, 0x66, 0x72, 0x61, 0x63, 0x74, 0x28,
+  0x69, 0x5f, 0x6c, 0x65, 0x67, 0x50, 0x68, 0x61, 0x73, 0x65, 0x20, 0x2b,
+  0x20, 0x30, 0x2e, 0x35, 0x2a, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x28, 0x28,
+  0x70, 0x61, 0x69, 0x72, 0x20, 0x2b, 0x20, 0x6c, 0x65, 0x67, 0x29, 0x20,
+  0x26, 0x20, 0x31, 0x29, 0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x74, 0x6f, 0x20, 0x3d, 0x20, 0x63, 0x65, 0x6e, 0x74,
+  0x65, 0x72, 0x20, 0x2b, 0x20, 0x73, 0x69, 0x64, 0x65, 0x2a, 0x76, 0x65,
+  0x63, 0x33, 0x28, 0x2d, 0x64, 0x69, 0x72, 0x65, 0x63, 0x74, 0x69, 0x6f,
+  0x6e, 0x2e, 0x79, 0x2c, 0x20, 0x64, 0x69, 0x72, 0x65, 0x63, 0x74, 0x69,
+  0x6f, 0x6e, 0x2e, 0x78, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x29, 0x20, 0x2d,
+  0x20, 0x64, 0x69, 0x72, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x2a, 0x28,
+  0x73, 0x74, 0x65, 0x70, 0x20, 0x2d, 0x20, 0x30, 0x2e, 0x35, 0x29, 0x3b,
+  0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0a, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x76, 0x65, 0x63, 0x33, 0x20, 0x70, 0x65, 0x72, 0x70, 0x20, 0x3d, 0x20,
+  0x6e, 0x6f, 0x72, 0x6d, 0x61, 0x6c, 0x69, 0x7a, 0x65, 0x28, 0x63, 0x72,
+  0x6f, 0x73, 0x73, 0x28, 0x74, 0x6f, 0x20, 0x2d, 0x20, 0x66, 0x72, 0x6f,
+  0x6d, 0x2c, 0x20, 0x6e, 0x29, 0x29, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20,
+  0x76, 0x65, 0x63, 0x33, 0x20, 0x65, 0x6e, 0x64, 0x20, 0x3d, 0x20, 0x63,
+  0x6f, 0x72, 0x6e, 0x65, 0x72, 0x45, 0x6e, 0x64, 0x5b, 0x63, 0x6f, 0x72,
+  0x6e, 0x65, 0x72, 0x5d, 0x3d, 0x3d, 0x30, 0x20, 0x3f, 0x20, 0x66, 0x72,
+  0x6f, 0x6d, 0x20, 0x3a, 0x20, 0x74, 0x6f, 0x3b, 0x0a, 0x20, 0x20, 0x20,
+  0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x77, 0x69, 0x64, 0x74, 0x68,
+  0x20, 0x3d, 0x20, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x45, 0x6e, 0x64,
+  0x5b, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x5d, 0x3d, 0x3d, 0x30, 0x20,
+  0x3f, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x57, 0x69, 0x64, 0x74, 0x68, 0x20,
+  0x3a, 0x20, 0x74, 0x6f, 0x57, 0x69, 0x64, 0x74, 0x68, 0x3b, 0x0a, 0x20,
+  0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x6c,
+  0x6f, 0x6f, 0x70, 0x43, 0x6f, 0x6c, 0x6f, 0x72, 0x73, 0x5b, 0x69, 0x5f,
+  0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x49, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x25,
+  0x20, 0x38, 0x75, 0x5d, 0x3b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x6e, 0x6f,
+  0x72, 0x6d, 0x61, 0x6c, 0x20, 0x3d, 0x20, 0x6e, 0x3b, 0x0a, 0x20, 0x20,
+  0x20, 0x20, 0x67, 0x6c, 0x5f, 0x50, 0x6f, 0x73, 0x69, 0x74, 0x69, 0x6f,
+  0x6e, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x66, 0x6f, 0x72,
+  0x6d, 0x20, 0x2a, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x65, 0x6e, 0x64,
+  0x20, 0x2b, 0x20, 0x70, 0x65, 0x72, 0x70, 0x2a, 0x63, 0x6f, 0x72, 0x6e,
+  0x65, 0x72, 0x53, 0x69, 0x64, 0x65, 0x5b, 0x63, 0x6f, 0x72, 0x6e, 0x65,
+  0x72, 0x5d, 0x2a, 0x30, 0x2e, 0x35, 0x2a, 0x77, 0x69, 0x64, 0x74, 0x68,
+  0x2c, 0x20, 0x31, 0x2e, 0x30, 0x29, 0x3b, 0x0a, 0x7d, 0x0a, 0x00
+};
+unsigned int shaders_bug_vert_len = 2891;
@@ -0,0 +1,94 @@
+#version 330 core
+
+// One instance per bug. The bug is built here from 9 flat trapezoids of 6
+// vertices each: the body, 2 antennae and 6 legs, in that order. Drawing
+// fewer vertices leaves out the last parts, which is how the level of detail
+// is picked.
+layout (location = 0) in vec4 i_posOrientation;
+layout (location = 1) in float i_scale;
+layout (location = 2) in uint i_colorIndex;
+layout (location = 3) in float i_legPhase;
+
+uniform mat4 transform;
+uniform vec3 loopColors[8];
+uniform float time;
+uniform int pointMode;
+
+out vec3 color;
+out vec3 normal;
+
+// Same corner order as PushTrapezoid
+const int cornerEnd[6] = int[6](0, 0, 1, 1, 1, 0);
+const float cornerSide[6] = float[6](-1.0, 1.0, 1.0, 1.0, -1.0, -1.0);
+
+void main()
+{
+    int part = gl_VertexID/6;
+    int corner = gl_VertexID%6;
+    vec3 pos = i_posOrientation.xyz;
+    float c = sin(i_posOrientation.w);
+    float s = cos(i_posOrientation.w);
+    float scale = i_scale;
+    vec3 direction = vec3(c, s, 0.0);
+    vec3 bodyTo = pos + direction*scale;
+    float lineWidth = 0.06*scale;
+
+    vec3 from;
+    vec3 to;
+    float fromWidth = lineWidth;
+    float toWidth = lineWidth;
+    vec3 n = vec3(0.0, 0.0, 1.0);
+    if(part==0)
+    {
+        if(pointMode!=0)
+        {
+            from = pos - direction*0.4*scale;
+            to = pos + direction*0.4*scale;
+            fromWidth = 0.8*scale;
+            toWidth = 0.8*scale;
+        }
+        else
+        {
+            from = pos;
+            to = bodyTo;
+            fromWidth = 0.7*scale;
+            toWidth = 0.3*scale;
+        }
+    }
+    else if(part < 3)
+    {
+        float antennaTheta = time*6.0;
+        float antCos = cos(antennaTheta)*0.3*scale;
+        float antSin = sin(antennaTheta)*0.3*scale;
+        from = bodyTo;
+        if(part==1)
+        {
+            to = bodyTo + vec3(-scale*s*0.5 + antCos, scale*c*0.5 + antSin, scale);
+        }
+        else
+        {
+            to = bodyTo + vec3(scale*s*0.5 - antSin, -scale*c*0.5 + antCos, scale);
+        }
+        n = direction;
+    }
+    else
+    {
+        // Feet stay planted while the body moves a step forward and then
+        // jump ahead. Neighbouring legs step in turns.
+        int leg = part-3;
+        int pair = leg/2;
+        float side = (leg & 1)==0 ? 1.0 : -1.0;
+        from = mix(pos, bodyTo, 0.5*float(pair));
+        vec3 center = mix(pos, bodyTo, 0.5*float(pair) + 0.5);
+        center.z = from.z - 1.0;
+        float step = fract(i_legPhase + 0.5*float((pair + leg) & 1));
+        to = center + side*vec3(-direction.y, direction.x, 0.0) - direction*(step - 0.5);
+    }
+
+    vec3 perp = normalize(cross(to - from, n));
+    vec3 end = cornerEnd[corner]==0 ? from : to;
+    float width = cornerEnd[corner]==0 ? fromWidth : toWidth;
+    color = loopColors[i_colorIndex % 8u];
+    normal = n;
+    gl_Position = transform * vec4(end + perp*cornerSide[corner]*0.5*width, 1.0);
+}
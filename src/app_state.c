@@ -94,3 +94,92 @@ IsKeyActionDown(AppState *appState, KeyAction action)
 {
     return appState->isActionDown[action];
 }
+
+// Usage: exe [--headless <ticks>] [--seed <seed>] [--bugs-per-loop <n>]
+//            [--loops <n>] [--threads <n>] [--max-bugs <n>] [--max-loops <n>]
+//            [--spawn <bugs per tick>] [--despawn <bugs per tick>] [--cpu-bugs] [--flat-ground]
+//            [--bench-mesh <vertices>] [--bench-math] [--ground-cache <directory>]
+LaunchOptions
+ParseLaunchOptions(int argc, char **argv)
+{
+    LaunchOptions options = {};
+    options.nTicks = 1000;
+    options.nBenchVertices = 100000;
+    for(int argIdx = 1;
+            argIdx < argc;
+            argIdx++)
+    {
+        char *arg = argv[argIdx];
+        b32 hasValue = argIdx+1 < argc;
+        if(!strcmp(arg, "--headless"))
+        {
+            options.headless = 1;
+            if(hasValue && argv[argIdx+1][0]!='-')
+            {
+                options.nTicks = atoi(argv[++argIdx]);
+            }
+        }
+        else if(!strcmp(arg, "--seed") && hasValue)
+        {
+            options.seed = (ui32)strtoul(argv[++argIdx], NULL, 10);
+            options.hasSeed = 1;
+        }
+        else if(!strcmp(arg, "--bugs-per-loop") && hasValue)
+        {
+            options.bugsPerLoop = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--loops") && hasValue)
+        {
+            options.nLoops = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--threads") && hasValue)
+        {
+            options.nThreads = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--max-bugs") && hasValue)
+        {
+            options.maxBugs = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--max-loops") && hasValue)
+        {
+            options.maxLoops = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--spawn") && hasValue)
+        {
+            options.spawnPerTick = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--despawn") && hasValue)
+        {
+            options.despawnPerTick = atoi(argv[++argIdx]);
+        }
+        else if(!strcmp(arg, "--bench-mesh"))
+        {
+            options.benchMesh = 1;
+            if(hasValue && argv[argIdx+1][0]!='-')
+            {
+                options.nBenchVertices = atoi(argv[++argIdx]);
+            }
+        }
+        else if(!strcmp(arg, "--bench-math"))
+        {
+            options.benchMath = 1;
+        }
+        else if(!strcmp(arg, "--cpu-bugs"))
+        {
+            options.cpuBugs = 1;
+        }
+        else if(!strcmp(arg, "--flat-ground"))
+        {
+            options.flatGround = 1;
+        }
+        else if(!strcmp(arg, "--ground-cache") && hasValue)
+        {
+            options.groundCache = argv[++argIdx];
+        }
+        else
+        {
+            DebugOut("Unknown argument %s", arg);
+        }
+    }
+    return options;
+}
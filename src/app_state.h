@@ -25,3 +25,24 @@ struct AppState
     b32 isActionDown[NUM_KEY_ACTIONS];
     b32 wasActionDown[NUM_KEY_ACTIONS];
 };
+
+typedef struct
+{
+    b32 headless;
+    int nTicks;
+    ui32 seed;
+    b32 hasSeed;
+    int bugsPerLoop;
+    int nLoops;
+    int nThreads;
+    int maxBugs;
+    int maxLoops;
+    int spawnPerTick;
+    int despawnPerTick;
+    b32 cpuBugs;        // build bug geometry on the cpu instead of instancing
+    b32 flatGround;     // one normal per ground triangle, 6 times the vertices
+    char *groundCache;  // directory for finished ground chunks, NULL for none
+    b32 benchMesh;
+    int nBenchVertices;
+    b32 benchMath;
+} LaunchOptions;
@@ -7,104 +7,463 @@ CalculateFeetPos(Vec3 center, Vec3 direction, Vec3 feet[2])
 }
 
 internal inline Vec3
-GetBugCenter(int nBugs, Bug *bugs[nBugs])
+GetBugCenter(World *world, BugLoop *loop)
 {
+    BugArrays *bugs = &world->bugs;
     Vec3 center = vec3(0,0,0);
-    for(int bugIdx = 0;
-            bugIdx < nBugs;
-            bugIdx++)
+    for(int memberIdx = 0;
+            memberIdx < loop->nBugs;
+            memberIdx++)
+    {
+        int bugIdx = loop->bugs[memberIdx];
+        center = v3_add(center, vec3(bugs->x[bugIdx], bugs->y[bugIdx], bugs->z[bugIdx]));
+    }
+    return v3_muls(center, 1.0/loop->nBugs);
+}
+
+// Upper bound of the memory the loop member lists can take. Blocks of a size
+// are only allocated when the free list is empty, and every block above the
+// minimum size is at least a quarter full, see RemoveBugFromLoop. So the
+// blocks of each size hold at most 4*maxBugs, plus the one being replaced.
+internal size_t
+GetLoopMemberMemorySize(int maxLoops, int maxBugs)
+{
+    size_t size = (size_t)maxLoops*LOOP_MIN_CAPACITY*sizeof(int);
+    for(int capacity = LOOP_MIN_CAPACITY*2;
+            capacity < 2*maxBugs;
+            capacity*=2)
     {
-        center = v3_add(center, bugs[bugIdx]->pos);
+        size+=4*(size_t)maxBugs*sizeof(int) + capacity*sizeof(int);
     }
-    return v3_muls(center, 1.0/nBugs);
+    return size;
+}
+
+internal int
+GetCapacityClass(int capacity)
+{
+    int capacityClass = 0;
+    while((LOOP_MIN_CAPACITY<<capacityClass) < capacity)
+    {
+        capacityClass++;
+    }
+    Assert(capacityClass < LOOP_CAPACITY_CLASSES);
+    return capacityClass;
+}
+
+// Free blocks store the next free block in their first bytes.
+internal int *
+AllocateMemberBlock(World *world, int capacity)
+{
+    int capacityClass = GetCapacityClass(capacity);
+    int *block = world->freeMemberBlocks[capacityClass];
+    if(block)
+    {
+        world->freeMemberBlocks[capacityClass] = *(int **)block;
+    }
+    else
+    {
+        block = PushAlignedArray(world->arena, int, capacity, sizeof(int *));
+    }
+    return block;
+}
+
+internal void
+FreeMemberBlock(World *world, int *block, int capacity)
+{
+    int capacityClass = GetCapacityClass(capacity);
+    *(int **)block = world->freeMemberBlocks[capacityClass];
+    world->freeMemberBlocks[capacityClass] = block;
 }
 
 internal inline void
-SortBugsIntoLoops(World *world)
+AppendBugToLoop(World *world, int bugIdx, int loopNumber)
 {
-    int nBugsInLoop[world->nLoops];
-    int cumulativeBugs = 0;
-    memset(nBugsInLoop, 0, sizeof(nBugsInLoop));
-    for(int bugIdx = 0;
-            bugIdx < world->nBugs;
-            bugIdx++)
+    BugLoop *loop = world->loops+loopNumber;
+    if(loop->nBugs == loop->maxBugs)
     {
-        Bug *bug = world->bugs+bugIdx;
-        nBugsInLoop[bug->loopNumber]++;
+        int newCapacity = loop->maxBugs ? loop->maxBugs*2 : LOOP_MIN_CAPACITY;
+        int *newBugs = AllocateMemberBlock(world, newCapacity);
+        if(loop->bugs)
+        {
+            memcpy(newBugs, loop->bugs, loop->nBugs*sizeof(int));
+            FreeMemberBlock(world, loop->bugs, loop->maxBugs);
+        }
+        loop->bugs = newBugs;
+        loop->maxBugs = newCapacity;
+    }
+    world->bugs.loopNumber[bugIdx] = loopNumber;
+    world->bugs.loopSlot[bugIdx] = loop->nBugs;
+    loop->bugs[loop->nBugs++] = bugIdx;
+}
+
+// Swaps the last member into the slot of the removed bug. A block that drops
+// below a quarter full is swapped for one of half the size.
+internal inline void
+RemoveBugFromLoop(World *world, int bugIdx)
+{
+    BugArrays *bugs = &world->bugs;
+    BugLoop *loop = world->loops+bugs->loopNumber[bugIdx];
+    int slot = bugs->loopSlot[bugIdx];
+    Assert(loop->bugs[slot]==bugIdx);
+    int lastBug = loop->bugs[--loop->nBugs];
+    loop->bugs[slot] = lastBug;
+    bugs->loopSlot[lastBug] = slot;
+    if(loop->maxBugs > LOOP_MIN_CAPACITY && loop->nBugs < loop->maxBugs/4)
+    {
+        int newCapacity = loop->maxBugs/2;
+        int *newBugs = AllocateMemberBlock(world, newCapacity);
+        memcpy(newBugs, loop->bugs, loop->nBugs*sizeof(int));
+        FreeMemberBlock(world, loop->bugs, loop->maxBugs);
+        loop->bugs = newBugs;
+        loop->maxBugs = newCapacity;
+    }
+}
+
+internal inline void
+MoveBugToLoop(World *world, int bugIdx, int loopNumber)
+{
+    BugArrays *bugs = &world->bugs;
+    RemoveBugFromLoop(world, bugIdx);
+    AppendBugToLoop(world, bugIdx, loopNumber);
+    bugs->zVel[bugIdx]=1;
+    bugs->scale[bugIdx]+=0.25;
+    world->nTransfers++;
+}
+
+// Grows every bug array to newCapacity, keeping the first oldCapacity
+// entries. Everything refers to bugs by index, so nothing dangles.
+internal void
+ResizeBugArrays(MemoryArena *arena, BugArrays *bugs, int oldCapacity, int newCapacity)
+{
+    // Pad so the simd kernel never needs a masked tail
+    int o = (oldCapacity+BUG_SIMD_WIDTH-1) & ~(BUG_SIMD_WIDTH-1);
+    int n = (newCapacity+BUG_SIMD_WIDTH-1) & ~(BUG_SIMD_WIDTH-1);
+    bugs->x = ResizeAlignedArray(arena, bugs->x, o, n, BUG_ALIGNMENT);
+    bugs->y = ResizeAlignedArray(arena, bugs->y, o, n, BUG_ALIGNMENT);
+    bugs->z = ResizeAlignedArray(arena, bugs->z, o, n, BUG_ALIGNMENT);
+    bugs->zVel = ResizeAlignedArray(arena, bugs->zVel, o, n, BUG_ALIGNMENT);
+    bugs->orientation = ResizeAlignedArray(arena, bugs->orientation, o, n, BUG_ALIGNMENT);
+    bugs->scale = ResizeAlignedArray(arena, bugs->scale, o, n, BUG_ALIGNMENT);
+    bugs->loopNumber = ResizeAlignedArray(arena, bugs->loopNumber, o, n, BUG_ALIGNMENT);
+    bugs->loopSlot = ResizeAlignedArray(arena, bugs->loopSlot, o, n, BUG_ALIGNMENT);
+    bugs->lod = ResizeAlignedArray(arena, bugs->lod, o, n, BUG_ALIGNMENT);
+    // Scratch is refilled every tick, no need to copy it
+    bugs->sinOrientation = PushAlignedArray(arena, r32, n, BUG_ALIGNMENT);
+    bugs->cosOrientation = PushAlignedArray(arena, r32, n, BUG_ALIGNMENT);
+    bugs->speedRoll = PushAlignedArray(arena, r32, n, BUG_ALIGNMENT);
+    bugs->steerRoll = PushAlignedArray(arena, r32, n, BUG_ALIGNMENT);
+    bugs->prevX = ResizeAlignedArray(arena, bugs->prevX, o, n, BUG_ALIGNMENT);
+    bugs->prevY = ResizeAlignedArray(arena, bugs->prevY, o, n, BUG_ALIGNMENT);
+    bugs->prevZ = ResizeAlignedArray(arena, bugs->prevZ, o, n, BUG_ALIGNMENT);
+    bugs->prevOrientation = ResizeAlignedArray(arena, bugs->prevOrientation, o, n, BUG_ALIGNMENT);
+    for(int word = 0;
+            word < 4;
+            word++)
+    {
+        bugs->random.s[word] = ResizeAlignedArray(arena, bugs->random.s[word], o, n, BUG_ALIGNMENT);
+    }
+    bugs->feetFrom = ResizeAlignedArray(arena, bugs->feetFrom, o*6, n*6, BUG_ALIGNMENT);
+    bugs->feetTo = ResizeAlignedArray(arena, bugs->feetTo, o*6, n*6, BUG_ALIGNMENT);
+}
+
+// Sorts items into cells. itemCell[i] is the cell of item i or -1 to leave
+// it out. cellStart gets nCells+1 offsets into cellItems.
+internal void
+CountingSortIntoCells(int nItems, int *itemCell, int nCells, int *cellStart, int *cellItems)
+{
+    memset(cellStart, 0, (nCells+1)*sizeof(int));
+    for(int itemIdx = 0;
+            itemIdx < nItems;
+            itemIdx++)
+    {
+        if(itemCell[itemIdx] >= 0)
+        {
+            cellStart[itemCell[itemIdx]+1]++;
+        }
     }
+    for(int cell = 0;
+            cell < nCells;
+            cell++)
+    {
+        cellStart[cell+1]+=cellStart[cell];
+    }
+    // Scatter, cellStart[cell] is used as the insert cursor and ends up at
+    // the start of the next cell. Shift back afterwards.
+    for(int itemIdx = 0;
+            itemIdx < nItems;
+            itemIdx++)
+    {
+        if(itemCell[itemIdx] >= 0)
+        {
+            cellItems[cellStart[itemCell[itemIdx]]++] = itemIdx;
+        }
+    }
+    for(int cell = nCells;
+            cell > 0;
+            cell--)
+    {
+        cellStart[cell] = cellStart[cell-1];
+    }
+    cellStart[0] = 0;
+}
+
+internal void
+InitLoopGrid(MemoryArena *arena, LoopGrid *grid, r32 width, r32 height)
+{
+    grid->width = (int)(width/LOOP_GRID_CELL_SIZE)+1;
+    grid->height = (int)(height/LOOP_GRID_CELL_SIZE)+1;
+    grid->cellStart = PushArray(arena, int, grid->width*grid->height+1);
+}
+
+// The per loop arrays are rebuilt every tick, so they are not copied.
+internal void
+ResizeLoopGrid(MemoryArena *arena, LoopGrid *grid, int maxLoops)
+{
+    grid->cellLoops = PushArray(arena, int, maxLoops);
+    grid->loopCell = PushArray(arena, int, maxLoops);
+    grid->loopPos = PushArray(arena, Vec2, maxLoops);
+}
+
+internal inline int
+ClampInt(int value, int min, int max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+// Loops can drift a bit outside the world, those go in the border cells.
+internal void
+BuildLoopGrid(World *world)
+{
+    LoopGrid *grid = &world->loopGrid;
     for(int loopIdx = 0;
             loopIdx < world->nLoops;
             loopIdx++)
     {
         BugLoop *loop = world->loops+loopIdx;
-        loop->nBugs = 0;
-        loop->bugs = world->loopBugPointers+cumulativeBugs;
-        cumulativeBugs+=nBugsInLoop[loopIdx];
+        grid->loopPos[loopIdx] = vec2(loop->pos.x, loop->pos.y);
+        if(loop->nBugs > 0)
+        {
+            int cx = ClampInt((int)floorf(loop->pos.x/LOOP_GRID_CELL_SIZE), 0, grid->width-1);
+            int cy = ClampInt((int)floorf(loop->pos.y/LOOP_GRID_CELL_SIZE), 0, grid->height-1);
+            grid->loopCell[loopIdx] = cx + cy*grid->width;
+        }
+        else
+        {
+            grid->loopCell[loopIdx] = -1;
+        }
     }
-    for(int bugIdx = 0;
-            bugIdx < world->nBugs;
-            bugIdx++)
+    CountingSortIntoCells(world->nLoops, grid->loopCell, grid->width*grid->height,
+            grid->cellStart, grid->cellLoops);
+}
+
+// Nearest non-empty loop other than loopIdx, searched in growing rings of
+// cells around pos. Stops once no unvisited cell can hold a closer loop.
+internal int
+FindNearestLoop(World *world, int loopIdx, Vec2 pos)
+{
+    LoopGrid *grid = &world->loopGrid;
+    int cx = ClampInt((int)floorf(pos.x/LOOP_GRID_CELL_SIZE), 0, grid->width-1);
+    int cy = ClampInt((int)floorf(pos.y/LOOP_GRID_CELL_SIZE), 0, grid->height-1);
+    int maxRing = grid->width > grid->height ? grid->width : grid->height;
+    r32 minDist2 = 1000000.0*1000000.0;
+    int nearest = -1;
+    for(int ring = 0;
+            ring < maxRing;
+            ring++)
     {
-        Bug *bug = world->bugs+bugIdx;
-        BugLoop *loop = world->loops+bug->loopNumber;
-        loop->bugs[loop->nBugs++] = bug;
+        for(int y = cy-ring; y <= cy+ring; y++)
+        {
+            if(y < 0 || y >= grid->height) continue;
+            b32 isEdgeRow = y==cy-ring || y==cy+ring;
+            int xStep = isEdgeRow ? 1 : 2*ring;
+            for(int x = cx-ring; x <= cx+ring; x+=xStep)
+            {
+                if(x < 0 || x >= grid->width) continue;
+                int cell = x + y*grid->width;
+                for(int idx = grid->cellStart[cell];
+                        idx < grid->cellStart[cell+1];
+                        idx++)
+                {
+                    int otherIdx = grid->cellLoops[idx];
+                    if(otherIdx==loopIdx) continue;
+                    Vec2 otherPos = grid->loopPos[otherIdx];
+                    r32 dx = otherPos.x-pos.x;
+                    r32 dy = otherPos.y-pos.y;
+                    r32 dist2 = dx*dx + dy*dy;
+                    if(dist2 < minDist2 || (dist2==minDist2 && otherIdx < nearest))
+                    {
+                        minDist2 = dist2;
+                        nearest = otherIdx;
+                    }
+                }
+            }
+        }
+        if(nearest >= 0)
+        {
+            // Distance to the closest side of the searched block that does
+            // not lie on the grid border. Border cells also hold the loops
+            // outside the world, so those sides cover everything beyond.
+            r32 unsearched = 1000000.0;
+            if(cx-ring > 0) 
+                unsearched = fminf(unsearched, pos.x - (cx-ring)*LOOP_GRID_CELL_SIZE);
+            if(cx+ring < grid->width-1) 
+                unsearched = fminf(unsearched, (cx+ring+1)*LOOP_GRID_CELL_SIZE - pos.x);
+            if(cy-ring > 0) 
+                unsearched = fminf(unsearched, pos.y - (cy-ring)*LOOP_GRID_CELL_SIZE);
+            if(cy+ring < grid->height-1) 
+                unsearched = fminf(unsearched, (cy+ring+1)*LOOP_GRID_CELL_SIZE - pos.y);
+            if(minDist2 <= unsearched*unsearched)
+            {
+                break;
+            }
+        }
     }
+    return nearest;
 }
 
-internal inline void
-MoveBugToLoop(World *world, Bug *bug, int loopNumber)
+// Capacity doubles, up to the limit of the world config. The grid arrays are
+// scratch that is rebuilt every tick and only need the new size.
+internal void
+GrowBugCapacity(World *world, int newCapacity)
+{
+    if(newCapacity < 64)
+    {
+        newCapacity = 64;
+    }
+    if(newCapacity > world->bugLimit)
+    {
+        newCapacity = world->bugLimit;
+    }
+    Assert(newCapacity > world->maxBugs);
+    ResizeBugArrays(world->arena, &world->bugs, world->maxBugs, newCapacity);
+    BugGrid *grid = &world->grid;
+    grid->cellBugs = PushArray(world->arena, int, newCapacity);
+    grid->bugCell = PushArray(world->arena, int, newCapacity);
+    grid->bugLoop = PushArray(world->arena, int, newCapacity);
+    world->maxBugs = newCapacity;
+}
+
+// Moves the loop table, so BugLoop pointers are only valid until the next
+// AddLoop.
+internal void
+GrowLoopCapacity(World *world, int newCapacity)
 {
-    bug->loopNumber = loopNumber;
-    bug->zVel=1;
-    bug->scale+=0.25;
-    world->isLoopDistributionDirty = 1;
+    if(newCapacity < 16)
+    {
+        newCapacity = 16;
+    }
+    if(newCapacity > world->loopLimit)
+    {
+        newCapacity = world->loopLimit;
+    }
+    Assert(newCapacity > world->maxLoops);
+    world->loops = ResizeAlignedArray(world->arena, world->loops, 
+            world->maxLoops, newCapacity, BUG_ALIGNMENT);
+    world->loopSweepOrder = ResizeAlignedArray(world->arena, world->loopSweepOrder, 
+            world->maxLoops, newCapacity, BUG_ALIGNMENT);
+    world->grid.loopBugCount = PushArray(world->arena, int, newCapacity);
+    ResizeLoopGrid(world->arena, &world->loopGrid, newCapacity);
+    world->maxLoops = newCapacity;
 }
 
 internal inline BugLoop*
-AddLoop(MemoryArena *arena, World *world)
+AddLoop(World *world)
 {
-    BugLoop *loop = world->loops + world->nLoops++;
-    Assert(world->nLoops <= world->maxLoops);
+    if(world->nLoops==world->maxLoops)
+    {
+        GrowLoopCapacity(world, 2*world->maxLoops);
+    }
+    int loopIdx = world->nLoops++;
+    BugLoop *loop = world->loops + loopIdx;
+    world->loopSweepOrder[loopIdx] = loopIdx;
     loop->pos = vec3(RandomFloat(0, world->width), RandomFloat(0, world->height), 0);
     loop->radius = 20;
+    loop->prevPos = loop->pos;
+    loop->prevRadius = loop->radius;
     loop->speedFactor = RandomFloat(0.8, 1.0);
-    loop->bugs = PushArray(arena, Bug*, world->maxBugs);
+    loop->bugs = NULL;
     loop->nBugs = 0;
+    loop->maxBugs = 0;
     return loop;
 }
 
-internal inline Bug*
+internal inline int
 AddBug(World *world, int loopNumber)
 {
-    Bug *bug = world->bugs + world->nBugs++;
-    Assert(world->nBugs <= world->maxBugs);
+    if(world->nBugs==world->maxBugs)
+    {
+        GrowBugCapacity(world, 2*world->maxBugs);
+    }
+    int bugIdx = world->nBugs++;
+    BugArrays *bugs = &world->bugs;
     BugLoop *loop = world->loops+loopNumber;
-    bug->scale = 1.0;
-    bug->pos = vec3(loop->pos.x, loop->pos.y, 1.0);
-    bug->zVel = 1;
-    bug->loopNumber = loopNumber;
-    return bug;
+    bugs->scale[bugIdx] = 1.0;
+    bugs->x[bugIdx] = loop->pos.x;
+    bugs->y[bugIdx] = loop->pos.y;
+    bugs->z[bugIdx] = 1.0;
+    bugs->zVel[bugIdx] = 1;
+    bugs->orientation[bugIdx] = 0;
+    bugs->prevX[bugIdx] = bugs->x[bugIdx];
+    bugs->prevY[bugIdx] = bugs->y[bugIdx];
+    bugs->prevZ[bugIdx] = bugs->z[bugIdx];
+    bugs->prevOrientation[bugIdx] = 0;
+    bugs->lod[bugIdx] = BUG_LOD_FULL;
+    AppendBugToLoop(world, bugIdx, loopNumber);
+    SeedRandomStream(&bugs->random, bugIdx, world->seed);
+    return bugIdx;
 }
 
-internal inline void
-UpdateAndRenderLoops(World *world, Mesh *mesh)
+// Swaps the last bug into the place of the removed one. Bug indices are only
+// valid until the next RemoveBug.
+internal void
+RemoveBug(World *world, int bugIdx)
 {
-    if(world->isLoopDistributionDirty)
+    BugArrays *bugs = &world->bugs;
+    RemoveBugFromLoop(world, bugIdx);
+    int lastIdx = --world->nBugs;
+    if(bugIdx!=lastIdx)
     {
-        world->isLoopDistributionDirty = 0;
-        SortBugsIntoLoops(world);
+        bugs->x[bugIdx] = bugs->x[lastIdx];
+        bugs->y[bugIdx] = bugs->y[lastIdx];
+        bugs->z[bugIdx] = bugs->z[lastIdx];
+        bugs->zVel[bugIdx] = bugs->zVel[lastIdx];
+        bugs->orientation[bugIdx] = bugs->orientation[lastIdx];
+        bugs->scale[bugIdx] = bugs->scale[lastIdx];
+        bugs->loopNumber[bugIdx] = bugs->loopNumber[lastIdx];
+        bugs->loopSlot[bugIdx] = bugs->loopSlot[lastIdx];
+        bugs->lod[bugIdx] = bugs->lod[lastIdx];
+        bugs->prevX[bugIdx] = bugs->prevX[lastIdx];
+        bugs->prevY[bugIdx] = bugs->prevY[lastIdx];
+        bugs->prevZ[bugIdx] = bugs->prevZ[lastIdx];
+        bugs->prevOrientation[bugIdx] = bugs->prevOrientation[lastIdx];
+        for(int word = 0;
+                word < 4;
+                word++)
+        {
+            bugs->random.s[word][bugIdx] = bugs->random.s[word][lastIdx];
+        }
+        memcpy(bugs->feetFrom+bugIdx*6, bugs->feetFrom+lastIdx*6, 6*sizeof(Vec3));
+        memcpy(bugs->feetTo+bugIdx*6, bugs->feetTo+lastIdx*6, 6*sizeof(Vec3));
+        BugLoop *loop = world->loops+bugs->loopNumber[bugIdx];
+        loop->bugs[bugs->loopSlot[bugIdx]] = bugIdx;
     }
+}
+
+internal inline void
+UpdateLoops(World *world)
+{
+    BuildLoopGrid(world);
     for(int loopIdx = 0;
             loopIdx < world->nLoops;
             loopIdx++)
     {
         BugLoop *loop = world->loops + loopIdx;
-        mesh->colorState = world->loopColors[loopIdx%8];
-        PushLineCircle(mesh, v3_add(loop->pos, vec3(0,0,0.1)), loop->radius, 20, 0.1);
+        loop->prevPos = loop->pos;
+        loop->prevRadius = loop->radius;
         if(loop->nBugs > 0)
         {
             loop->radius = 2*sqrtf(loop->nBugs);
-            Vec3 center = GetBugCenter(loop->nBugs, loop->bugs);
+            Vec3 center = GetBugCenter(world, loop);
             loop->pos = lerp(center, loop->pos, 0.95);
         }
         else
@@ -117,29 +476,14 @@ UpdateAndRenderLoops(World *world, Mesh *mesh)
             // Do loop ai. Check for closest loop. If bigger then move away. 
             // If smaller move towards
             r32 aiSpeed = world->aiSpeed * loop->speedFactor;
-            r32 minDist = 1000000.0;
-            BugLoop *nearestEnemy = NULL;
-            Vec3 nearestDiff;
-
-            for(int enemyIdx = 0;
-                    enemyIdx < world->nLoops;
-                    enemyIdx++)
+            int nearestIdx = FindNearestLoop(world, loopIdx, vec2(loop->pos.x, loop->pos.y));
+            BugLoop *nearestEnemy = nearestIdx >= 0 ? world->loops+nearestIdx : NULL;
+            Vec3 nearestDiff = vec3(0,0,0);
+            r32 minDist = 0;
+            if(nearestEnemy)
             {
-                if(enemyIdx!=loopIdx)
-                {
-                    BugLoop *enemy = world->loops+enemyIdx;
-                    if(enemy->nBugs > 0)
-                    {
-                        Vec3 diff = v3_sub(enemy->pos, loop->pos);
-                        r32 dist = v3_length(diff);
-                        if(dist < minDist)
-                        {
-                            minDist = dist;
-                            nearestEnemy = enemy;
-                            nearestDiff = diff;
-                        }
-                    }
-                }
+                nearestDiff = v3_sub(nearestEnemy->pos, loop->pos);
+                minDist = v3_length(nearestDiff);
             }
             if(nearestEnemy!=NULL && minDist > loop->radius/2)
             {
@@ -176,142 +520,512 @@ UpdateAndRenderLoops(World *world, Mesh *mesh)
     }
 }
 
+// Draws the loops between the last two ticks, alpha 0 is the previous tick.
+// Circles outside the frustum are skipped.
 internal inline void
-CollideLoops(World *world, BugLoop *loopA, BugLoop *loopB)
-{
-    int total = loopA->nBugs+loopB->nBugs;
-    r32 probA = ((r32)loopA->nBugs)/((r32)total);
-    for(int bug0Idx = 0; 
-            bug0Idx < loopA->nBugs;
-            bug0Idx++)
-    {
-        Bug *bug0 = loopA->bugs[bug0Idx];
-        for(int bug1Idx = 0;
-                bug1Idx < loopB->nBugs;
-                bug1Idx++)
-        {
-            Bug *bug1 = loopB->bugs[bug1Idx];
-            r32 dx = bug1->pos.x-bug0->pos.x;
-            r32 dy = bug1->pos.y-bug0->pos.y;
-            r32 len2 = dx*dx + dy*dy;
-            if(len2 < 4)
-            {
-                if(RandomFloat(0.0, 1.0) < 0.1)
-                {
-                    if(RandomFloat(0.0, 1.0) < probA)
-                    {
-                        MoveBugToLoop(world, bug1, bug0->loopNumber);
-                    }
-                    else
-                    {
-                        MoveBugToLoop(world, bug0, bug1->loopNumber);
-                    }
-                }
-            }
+EmitLoopGeometry(World *world, Mesh *mesh, Frustum *frustum, r32 alpha, CullStats *stats)
+{
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        BugLoop *loop = world->loops + loopIdx;
+        mesh->colorState = world->loopColors[loopIdx%8];
+        Vec3 pos = lerp(loop->prevPos, loop->pos, alpha);
+        r32 radius = loop->prevRadius + (loop->radius-loop->prevRadius)*alpha;
+        if(!IsSphereInFrustum(frustum, pos, radius+0.1))
+        {
+            stats->loopsCulled++;
+            continue;
         }
+        stats->loopsDrawn++;
+        PushLineCircle(mesh, v3_add(pos, vec3(0,0,0.1)), radius, 20, 0.1);
     }
 }
 
-internal inline void
-UpdateAndRenderBugs(World *world, Mesh *mesh)
+internal void
+InitBugGrid(MemoryArena *arena, BugGrid *grid, r32 width, r32 height)
+{
+    grid->width = (int)(width/BUG_GRID_CELL_SIZE)+1;
+    grid->height = (int)(height/BUG_GRID_CELL_SIZE)+1;
+    grid->cellStart = PushArray(arena, int, grid->width*grid->height+1);
+}
+
+internal void
+UpdateLoopBounds(World *world)
 {
-    // Render dynamic
-    local_persist r32 time = 0;
-    time += 1.0/60;
-    r32 speedFactor = 0.6;
+    BugArrays *bugs = &world->bugs;
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        BugLoop *loop = world->loops+loopIdx;
+        loop->boundsMin = vec2(world->width, world->height);
+        loop->boundsMax = vec2(0, 0);
+        loop->maxBugScale = 0;
+        loop->hasContact = 0;
+    }
     for(int bugIdx = 0;
             bugIdx < world->nBugs;
             bugIdx++)
     {
-        Bug *bug = world->bugs+bugIdx;
-        mesh->colorState = world->loopColors[bug->loopNumber%8];
-        r32 speed = speedFactor * RandomFloat(0, 1);
+        BugLoop *loop = world->loops+bugs->loopNumber[bugIdx];
+        r32 x = bugs->x[bugIdx];
+        r32 y = bugs->y[bugIdx];
+        if(bugs->scale[bugIdx] > loop->maxBugScale) loop->maxBugScale = bugs->scale[bugIdx];
+        if(x < loop->boundsMin.x) loop->boundsMin.x = x;
+        if(y < loop->boundsMin.y) loop->boundsMin.y = y;
+        if(x > loop->boundsMax.x) loop->boundsMax.x = x;
+        if(y > loop->boundsMax.y) loop->boundsMax.y = y;
+    }
+    r32 margin = BUG_GRID_CELL_SIZE/2;
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        BugLoop *loop = world->loops+loopIdx;
+        loop->boundsMin = vec2(loop->boundsMin.x-margin, loop->boundsMin.y-margin);
+        loop->boundsMax = vec2(loop->boundsMax.x+margin, loop->boundsMax.y+margin);
+    }
+}
+
+internal inline b32
+DoLoopBoundsOverlap(BugLoop *a, BugLoop *b)
+{
+    return a->boundsMin.x <= b->boundsMax.x && b->boundsMin.x <= a->boundsMax.x &&
+        a->boundsMin.y <= b->boundsMax.y && b->boundsMin.y <= a->boundsMax.y;
+}
 
-        // Loop calculations
-        BugLoop *loop = world->loops + bug->loopNumber;
-        r32 loopInfluence = 0.14;
-        Vec3 loopDiff = v3_sub(bug->pos, loop->pos);
-        r32 loopDist = v3_length(loopDiff);
-        r32 distToLoop = loopDist-loop->radius;
-        r32 absDistToLoop = distToLoop < 0.0 ? -distToLoop : distToLoop;
-        if(absDistToLoop > 10.0)
+// Sweep and prune over the loop bounds. The sweep order is kept between ticks
+// and fixed with an insertion sort, which is close to linear because loops
+// move little per tick. Marks every loop that is part of a candidate pair.
+internal void
+SweepLoopBounds(World *world)
+{
+    int *order = world->loopSweepOrder;
+    for(int orderIdx = 1;
+            orderIdx < world->nLoops;
+            orderIdx++)
+    {
+        int loopIdx = order[orderIdx];
+        r32 minX = world->loops[loopIdx].boundsMin.x;
+        int insertIdx = orderIdx;
+        while(insertIdx > 0 && world->loops[order[insertIdx-1]].boundsMin.x > minX)
         {
-            speed*=2;
+            order[insertIdx] = order[insertIdx-1];
+            insertIdx--;
         }
+        order[insertIdx] = loopIdx;
+    }
 
-        r32 c = sinf(bug->orientation);
-        r32 s = cosf(bug->orientation);
-        bug->zVel-=0.05;
-        bug->pos = v3_add(bug->pos, vec3(c*speed, s*speed, 0));
-        bug->pos.z+=bug->zVel;
-        if(bug->pos.z < 1.0)
+    world->nLoopPairs = 0;
+    for(int orderIdx = 0;
+            orderIdx < world->nLoops;
+            orderIdx++)
+    {
+        BugLoop *loopA = world->loops+order[orderIdx];
+        if(loopA->boundsMin.x > loopA->boundsMax.x)
         {
-            bug->pos.z = 1.00;
-            bug->zVel*=-0.8;
+            // Empty loop
+            continue;
         }
-
-        // See if loop center is left or right of bug. Move accordingly
-        r32 perpDot = -loopDiff.x*s + loopDiff.y*c;
-        if(perpDot > 0)
+        for(int otherIdx = orderIdx+1;
+                otherIdx < world->nLoops;
+                otherIdx++)
         {
-            if(distToLoop > 0)
+            BugLoop *loopB = world->loops+order[otherIdx];
+            if(loopB->boundsMin.x > loopA->boundsMax.x)
             {
-                bug->orientation += RandomFloat(0, loopInfluence);
+                break;
             }
-            else
+            if(DoLoopBoundsOverlap(loopA, loopB))
             {
-                bug->orientation -= RandomFloat(0, loopInfluence);
+                loopA->hasContact = 1;
+                loopB->hasContact = 1;
+                world->nLoopPairs++;
             }
         }
+    }
+}
+
+// Only bugs of loops that are part of a candidate pair go into the grid.
+internal void
+BuildBugGrid(World *world)
+{
+    BugGrid *grid = &world->grid;
+    BugArrays *bugs = &world->bugs;
+    r32 invCellSize = 1.0f/BUG_GRID_CELL_SIZE;
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        grid->loopBugCount[loopIdx] = world->loops[loopIdx].nBugs;
+    }
+    for(int bugIdx = 0;
+            bugIdx < world->nBugs;
+            bugIdx++)
+    {
+        grid->bugLoop[bugIdx] = bugs->loopNumber[bugIdx];
+        if(world->loops[grid->bugLoop[bugIdx]].hasContact)
+        {
+            // Bugs are bounded to the world, so no cell clamping needed
+            int cx = (int)(bugs->x[bugIdx]*invCellSize);
+            int cy = (int)(bugs->y[bugIdx]*invCellSize);
+            grid->bugCell[bugIdx] = cx + cy*grid->width;
+        }
         else
         {
-            if(distToLoop > 0)
-            {
-                bug->orientation -= RandomFloat(0, loopInfluence);
-            }
-            else
-            {
-                bug->orientation += RandomFloat(0, loopInfluence);
-            }
+            grid->bugCell[bugIdx] = -1;
         }
+    }
+    CountingSortIntoCells(world->nBugs, grid->bugCell, grid->width*grid->height,
+            grid->cellStart, grid->cellBugs);
+}
 
-        // Bound bug
-        if(bug->pos.x < 0)
+// Transfer rule for two touching bugs of different loops. loopA is the loop
+// with the lower index, which is the order the old loop pair scan used. The
+// odds use the loop sizes at the start of the pass, not the live ones. Only
+// records the transfer, ApplyBugTransfers moves the bug. The rolls are hashed
+// from the pair so they do not depend on the thread that finds it.
+internal inline void
+CollideBugPair(World *world, WorkerScratch *events, int idx0, int idx1)
+{
+    BugGrid *grid = &world->grid;
+    int bug0 = grid->cellBugs[idx0];
+    int bug1 = grid->cellBugs[idx1];
+    if(grid->bugLoop[bug0] > grid->bugLoop[bug1])
+    {
+        int tmp = bug0;
+        bug0 = bug1;
+        bug1 = tmp;
+    }
+    int nBugsA = grid->loopBugCount[grid->bugLoop[bug0]];
+    int nBugsB = grid->loopBugCount[grid->bugLoop[bug1]];
+    r32 probA = ((r32)nBugsA)/((r32)(nBugsA+nBugsB));
+    if(RandomHashUnilateral(world->seed, bug0, bug1, 2*world->tick) < 0.1)
+    {
+        TransferEvent *event = (TransferEvent *)PushScratch(events, sizeof(TransferEvent));
+        event->order = ((ui64)idx0 << 32) | (ui32)idx1;
+        if(RandomHashUnilateral(world->seed, bug0, bug1, 2*world->tick+1) < probA)
         {
-            bug->pos.x = 0;
+            event->bug = bug1;
+            event->otherBug = bug0;
         }
-        if(bug->pos.y < 0)
+        else
         {
-            bug->pos.y=0;
+            event->bug = bug0;
+            event->otherBug = bug1;
         }
-        if(bug->pos.x > world->width)
+    }
+}
+
+typedef struct
+{
+    World *world;
+    WorkerPool *pool;
+} CollisionJob;
+
+// Tests every bug in one row of cells against the bugs in its own and the
+// neighbouring cells. Only half of the 3x3 neighbourhood is visited so each
+// pair is seen once. Bugs of loops whose bounds do not overlap are skipped.
+// Reads only the grid and bug positions, so rows can run on any thread.
+internal void
+CollideBugRow(void *data, int cy, int threadIdx)
+{
+    CollisionJob *job = (CollisionJob *)data;
+    World *world = job->world;
+    WorkerScratch *events = job->pool->scratch+threadIdx;
+    BugGrid *grid = &world->grid;
+    BugArrays *bugs = &world->bugs;
+    local_persist int neighbourOffsets[4][2] = {{1,0}, {-1,1}, {0,1}, {1,1}};
+    for(int cx = 0;
+            cx < grid->width;
+            cx++)
+    {
+        int cell = cx + cy*grid->width;
+        for(int idx0 = grid->cellStart[cell];
+                idx0 < grid->cellStart[cell+1];
+                idx0++)
         {
-            bug->pos.x = world->width;
+            int bug0 = grid->cellBugs[idx0];
+            r32 x0 = bugs->x[bug0];
+            r32 y0 = bugs->y[bug0];
+            int loop0 = grid->bugLoop[bug0];
+            BugLoop *bugLoop0 = world->loops+loop0;
+            for(int neighbourIdx = -1;
+                    neighbourIdx < 4;
+                    neighbourIdx++)
+            {
+                int first;
+                int end;
+                if(neighbourIdx < 0)
+                {
+                    first = idx0+1;
+                    end = grid->cellStart[cell+1];
+                }
+                else
+                {
+                    int nx = cx+neighbourOffsets[neighbourIdx][0];
+                    int ny = cy+neighbourOffsets[neighbourIdx][1];
+                    if(nx < 0 || nx >= grid->width || ny >= grid->height)
+                    {
+                        continue;
+                    }
+                    int neighbour = nx + ny*grid->width;
+                    first = grid->cellStart[neighbour];
+                    end = grid->cellStart[neighbour+1];
+                }
+                for(int idx1 = first;
+                        idx1 < end;
+                        idx1++)
+                {
+                    int bug1 = grid->cellBugs[idx1];
+                    int loop1 = grid->bugLoop[bug1];
+                    if(loop1==loop0 || !DoLoopBoundsOverlap(bugLoop0, world->loops+loop1))
+                    {
+                        continue;
+                    }
+                    r32 dx = bugs->x[bug1]-x0;
+                    r32 dy = bugs->y[bug1]-y0;
+                    r32 len2 = dx*dx + dy*dy;
+                    if(len2 < 4)
+                    {
+                        CollideBugPair(world, events, idx0, idx1);
+                    }
+                }
+            }
         }
-        if(bug->pos.y > world->height)
+    }
+}
+
+internal int
+CompareTransferEvents(const void *a, const void *b)
+{
+    ui64 x = ((TransferEvent *)a)->order;
+    ui64 y = ((TransferEvent *)b)->order;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Gathers the events of all threads behind the ones of thread 0 and applies
+// them in scan order, so the outcome does not depend on the thread count. The
+// bug joins the loop the other bug is in by now, as in the serial scan.
+internal void
+ApplyBugTransfers(World *world, WorkerPool *pool)
+{
+    WorkerScratch *merged = pool->scratch;
+    for(int threadIdx = 1;
+            threadIdx < pool->nThreads;
+            threadIdx++)
+    {
+        WorkerScratch *events = pool->scratch+threadIdx;
+        memcpy(PushScratch(merged, events->used), events->base, events->used);
+    }
+    TransferEvent *transfers = (TransferEvent *)merged->base;
+    int nTransfers = merged->used/sizeof(TransferEvent);
+    qsort(transfers, nTransfers, sizeof(TransferEvent), CompareTransferEvents);
+    for(int transferIdx = 0;
+            transferIdx < nTransfers;
+            transferIdx++)
+    {
+        TransferEvent *transfer = transfers+transferIdx;
+        MoveBugToLoop(world, transfer->bug, world->bugs.loopNumber[transfer->otherBug]);
+    }
+}
+
+internal void
+CollideBugs(World *world, WorkerPool *pool)
+{
+    UpdateLoopBounds(world);
+    SweepLoopBounds(world);
+    BuildBugGrid(world);
+    for(int threadIdx = 0;
+            threadIdx < pool->nThreads;
+            threadIdx++)
+    {
+        pool->scratch[threadIdx].used = 0;
+    }
+    CollisionJob job = {world, pool};
+    RunParallel(pool, world->grid.height, CollideBugRow, &job);
+    ApplyBugTransfers(world, pool);
+}
+
+// Scalar version of the locomotion kernel. Moves, bounces, steers and bounds
+// one bug. Expects sin/cosOrientation, speedRoll and steerRoll to be filled.
+internal inline void
+MoveBug(World *world, int bugIdx)
+{
+    BugArrays *bugs = &world->bugs;
+    r32 speedFactor = 0.6f;
+    r32 loopInfluence = 0.14f;
+    r32 speed = speedFactor*bugs->speedRoll[bugIdx];
+
+    // Loop calculations
+    BugLoop *loop = world->loops + bugs->loopNumber[bugIdx];
+    r32 dx = bugs->x[bugIdx]-loop->pos.x;
+    r32 dy = bugs->y[bugIdx]-loop->pos.y;
+    r32 dz = bugs->z[bugIdx]-loop->pos.z;
+    r32 distToLoop = sqrtf(dx*dx + dy*dy + dz*dz)-loop->radius;
+    if(fabsf(distToLoop) > 10.0f)
+    {
+        speed*=2;
+    }
+
+    r32 c = bugs->sinOrientation[bugIdx];
+    r32 s = bugs->cosOrientation[bugIdx];
+    r32 zVel = bugs->zVel[bugIdx]-0.05f;
+    r32 x = bugs->x[bugIdx]+c*speed;
+    r32 y = bugs->y[bugIdx]+s*speed;
+    r32 z = bugs->z[bugIdx]+zVel;
+    if(z < 1.0f)
+    {
+        z = 1.0f;
+        zVel*=-0.8f;
+    }
+
+    // See if loop center is left or right of bug. Move accordingly
+    r32 perpDot = -dx*s + dy*c;
+    r32 steer = loopInfluence*bugs->steerRoll[bugIdx];
+    bugs->orientation[bugIdx] += (perpDot > 0) == (distToLoop > 0) ? steer : -steer;
+
+    // Bound bug
+    if(x < 0) x = 0;
+    if(y < 0) y = 0;
+    if(x > world->width) x = world->width;
+    if(y > world->height) y = world->height;
+    bugs->x[bugIdx] = x;
+    bugs->y[bugIdx] = y;
+    bugs->z[bugIdx] = z;
+    bugs->zVel[bugIdx] = zVel;
+}
+
+// Locomotion kernel over [begin, end). begin has to be a multiple of
+// BUG_SIMD_WIDTH. Does the same as MoveBug, four bugs at a time.
+internal void
+MoveBugs(World *world, int begin, int end)
+{
+    int bugIdx = begin;
+#if defined(__SSE2__)
+    BugArrays *bugs = &world->bugs;
+    __m128 speedFactor = _mm_set1_ps(0.6f);
+    __m128 loopInfluence = _mm_set1_ps(0.14f);
+    __m128 gravity = _mm_set1_ps(0.05f);
+    __m128 bounce = _mm_set1_ps(-0.8f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 ten = _mm_set1_ps(10.0f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 width = _mm_set1_ps(world->width);
+    __m128 height = _mm_set1_ps(world->height);
+    for(; 
+            bugIdx+BUG_SIMD_WIDTH <= end;
+            bugIdx+=BUG_SIMD_WIDTH)
+    {
+        BugLoop *l0 = world->loops + bugs->loopNumber[bugIdx];
+        BugLoop *l1 = world->loops + bugs->loopNumber[bugIdx+1];
+        BugLoop *l2 = world->loops + bugs->loopNumber[bugIdx+2];
+        BugLoop *l3 = world->loops + bugs->loopNumber[bugIdx+3];
+        __m128 loopX = _mm_setr_ps(l0->pos.x, l1->pos.x, l2->pos.x, l3->pos.x);
+        __m128 loopY = _mm_setr_ps(l0->pos.y, l1->pos.y, l2->pos.y, l3->pos.y);
+        __m128 loopZ = _mm_setr_ps(l0->pos.z, l1->pos.z, l2->pos.z, l3->pos.z);
+        __m128 loopRadius = _mm_setr_ps(l0->radius, l1->radius, l2->radius, l3->radius);
+
+        __m128 x = _mm_load_ps(bugs->x+bugIdx);
+        __m128 y = _mm_load_ps(bugs->y+bugIdx);
+        __m128 z = _mm_load_ps(bugs->z+bugIdx);
+        __m128 zVel = _mm_load_ps(bugs->zVel+bugIdx);
+        __m128 c = _mm_load_ps(bugs->sinOrientation+bugIdx);
+        __m128 s = _mm_load_ps(bugs->cosOrientation+bugIdx);
+        __m128 speed = _mm_mul_ps(speedFactor, _mm_load_ps(bugs->speedRoll+bugIdx));
+
+        __m128 dx = _mm_sub_ps(x, loopX);
+        __m128 dy = _mm_sub_ps(y, loopY);
+        __m128 dz = _mm_sub_ps(z, loopZ);
+        __m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 distToLoop = _mm_sub_ps(_mm_sqrt_ps(dist2), loopRadius);
+        __m128 isFar = _mm_cmpgt_ps(_mm_andnot_ps(signMask, distToLoop), ten);
+        speed = _mm_add_ps(speed, _mm_and_ps(isFar, speed));
+
+        zVel = _mm_sub_ps(zVel, gravity);
+        x = _mm_add_ps(x, _mm_mul_ps(c, speed));
+        y = _mm_add_ps(y, _mm_mul_ps(s, speed));
+        z = _mm_add_ps(z, zVel);
+        __m128 isGrounded = _mm_cmplt_ps(z, one);
+        z = _mm_or_ps(_mm_and_ps(isGrounded, one), _mm_andnot_ps(isGrounded, z));
+        zVel = _mm_or_ps(_mm_and_ps(isGrounded, _mm_mul_ps(zVel, bounce)), 
+                _mm_andnot_ps(isGrounded, zVel));
+
+        // Steer right when the loop center side and distance sign agree, left otherwise
+        __m128 perpDot = _mm_sub_ps(_mm_mul_ps(dy, c), _mm_mul_ps(dx, s));
+        __m128 disagree = _mm_xor_ps(_mm_cmpgt_ps(perpDot, zero), _mm_cmpgt_ps(distToLoop, zero));
+        __m128 steer = _mm_mul_ps(loopInfluence, _mm_load_ps(bugs->steerRoll+bugIdx));
+        steer = _mm_xor_ps(steer, _mm_and_ps(disagree, signMask));
+        _mm_store_ps(bugs->orientation+bugIdx, _mm_add_ps(_mm_load_ps(bugs->orientation+bugIdx), steer));
+
+        x = _mm_min_ps(_mm_max_ps(x, zero), width);
+        y = _mm_min_ps(_mm_max_ps(y, zero), height);
+        _mm_store_ps(bugs->x+bugIdx, x);
+        _mm_store_ps(bugs->y+bugIdx, y);
+        _mm_store_ps(bugs->z+bugIdx, z);
+        _mm_store_ps(bugs->zVel+bugIdx, zVel);
+    }
+#endif
+    for(;
+            bugIdx < end;
+            bugIdx++)
+    {
+        MoveBug(world, bugIdx);
+    }
+}
+
+internal inline void
+UpdateBugLods(World *world, int begin, int end)
+{
+    BugArrays *bugs = &world->bugs;
+    r32 fullDistance2 = BUG_LOD_FULL_DISTANCE*BUG_LOD_FULL_DISTANCE;
+    r32 bodyDistance2 = BUG_LOD_BODY_DISTANCE*BUG_LOD_BODY_DISTANCE;
+    Vec3 viewerPos = world->viewerPos;
+    for(int bugIdx = begin;
+            bugIdx < end;
+            bugIdx++)
+    {
+        r32 dx = bugs->x[bugIdx]-viewerPos.x;
+        r32 dy = bugs->y[bugIdx]-viewerPos.y;
+        r32 dz = bugs->z[bugIdx]-viewerPos.z;
+        r32 distance2 = dx*dx + dy*dy + dz*dz;
+        if(!world->hasViewer || distance2 < fullDistance2)
+        {
+            bugs->lod[bugIdx] = BUG_LOD_FULL;
+        }
+        else
         {
-            bug->pos.y = world->height;
+            bugs->lod[bugIdx] = distance2 < bodyDistance2 ? BUG_LOD_BODY : BUG_LOD_POINT;
         }
+    }
+}
 
-        // Draw Body
-        r32 scale = bug->scale;
-        r32 lineWidth = scale*0.06;
-        Vec3 from = bug->pos;
-        Vec3 to = v3_add(from, vec3(c*scale, s*scale, 0));
-        PushTrapezoid(mesh, from, to, 0.7*scale, 0.3*scale, vec3(0,0,1));
-
-        // Draw antenna
-        r32 antennaTheta = time * 6;
-        r32 antennaMovement = 0.3;
-        r32 antCos = cosf(antennaTheta)*antennaMovement*scale;
-        r32 antSin = sinf(antennaTheta)*antennaMovement*scale;
-        Vec3 antenna0 = v3_add(to, vec3(-scale*s*0.5 + antCos, scale*c*0.5+antSin, scale));
-        Vec3 antenna1 = v3_add(to, vec3(scale*s*0.5 -antSin, -scale*c*0.5+antCos, scale));
-        PushLine(mesh, to, antenna0, lineWidth, vec3(c,s,0));
-        PushLine(mesh, to, antenna1, lineWidth, vec3(c,s,0));
-
-        // Draw and update feet
+// Feet are only looks, the jitter is hashed so skipping bugs that are drawn
+// without legs, or all of them when instancing, does not change the
+// simulation.
+internal inline void
+UpdateBugFeet(World *world, int begin, int end)
+{
+    BugArrays *bugs = &world->bugs;
+    for(int bugIdx = begin;
+            bugIdx < end;
+            bugIdx++)
+    {
+        if(bugs->lod[bugIdx]!=BUG_LOD_FULL)
+        {
+            continue;
+        }
+        r32 c = bugs->sinOrientation[bugIdx];
+        r32 s = bugs->cosOrientation[bugIdx];
+        r32 scale = bugs->scale[bugIdx];
+        Vec3 *feetFrom = bugs->feetFrom + bugIdx*6;
+        Vec3 *feetTo = bugs->feetTo + bugIdx*6;
         Vec3 feet[6];
+        Vec3 from = vec3(bugs->x[bugIdx], bugs->y[bugIdx], bugs->z[bugIdx]);
+        Vec3 to = v3_add(from, vec3(c*scale, s*scale, 0));
         Vec3 groundFrom = from;
         Vec3 groundTo = to;
         groundFrom.z = 0;
@@ -323,8 +1037,8 @@ UpdateAndRenderBugs(World *world, Mesh *mesh)
                 feetPairIdx++)
         {
             Vec3 bodyPos = lerp(from, to, 0.5*feetPairIdx);
-            bug->feetFrom[feetPairIdx*2] = bodyPos;
-            bug->feetFrom[feetPairIdx*2+1] = bodyPos;
+            feetFrom[feetPairIdx*2] = bodyPos;
+            feetFrom[feetPairIdx*2+1] = bodyPos;
             Vec3 center = lerp(groundFrom, groundTo, 0.5*feetPairIdx+0.5); // A little ahead
             center.z = bodyPos.z-1.0;
             CalculateFeetPos(center, direction, feet+feetPairIdx*2); 
@@ -335,32 +1049,502 @@ UpdateAndRenderBugs(World *world, Mesh *mesh)
                 footIdx++)
         {
             Vec3 newFootPos = feet[footIdx];
-            Vec3 footPos = bug->feetTo[footIdx];
+            Vec3 footPos = feetTo[footIdx];
             r32 diff = v3_length(v3_sub(newFootPos, footPos));
             if(diff > 1)
             {
-                bug->feetTo[footIdx] = vec3(newFootPos.x + RandomFloat(-0.2, 0.2), 
-                        newFootPos.y+RandomFloat(-0.2, 0.2), 
+                r32 jitterX = RandomHashUnilateral(world->seed, bugIdx, 2*footIdx, world->tick);
+                r32 jitterY = RandomHashUnilateral(world->seed, bugIdx, 2*footIdx+1, world->tick);
+                feetTo[footIdx] = vec3(newFootPos.x + 0.4*jitterX-0.2, 
+                        newFootPos.y + 0.4*jitterY-0.2, 
                         newFootPos.z);
             }
-            PushLine(mesh, bug->feetFrom[footIdx], bug->feetTo[footIdx], lineWidth, vec3(0,0,1));
         }
     }
-#if 1
-    for(int loopAIdx = 0;
-            loopAIdx < world->nLoops -1;
-            loopAIdx++)
+}
+
+// Worker task of the bug pass. Bugs only read the loops and their own
+// state, so chunks can run in any order on any thread.
+internal void
+UpdateBugChunk(void *data, int chunkIdx, int threadIdx)
+{
+    World *world = (World *)data;
+    BugArrays *bugs = &world->bugs;
+    int begin = chunkIdx*BUG_CHUNK_SIZE;
+    int end = begin+BUG_CHUNK_SIZE < world->nBugs ? begin+BUG_CHUNK_SIZE : world->nBugs;
+    size_t chunkBytes = (end-begin)*sizeof(r32);
+    memcpy(bugs->prevX+begin, bugs->x+begin, chunkBytes);
+    memcpy(bugs->prevY+begin, bugs->y+begin, chunkBytes);
+    memcpy(bugs->prevZ+begin, bugs->z+begin, chunkBytes);
+    memcpy(bugs->prevOrientation+begin, bugs->orientation+begin, chunkBytes);
+    SinCosFill(bugs->orientation, begin, end, bugs->sinOrientation, bugs->cosOrientation);
+    RandomFillUnilateral(&bugs->random, begin, end, bugs->speedRoll);
+    RandomFillUnilateral(&bugs->random, begin, end, bugs->steerRoll);
+    MoveBugs(world, begin, end);
+    UpdateBugLods(world, begin, end);
+    if(world->animateFeet)
+    {
+        UpdateBugFeet(world, begin, end);
+    }
+}
+
+// Only changes bug state, the geometry is built by EmitBugGeometry.
+internal inline void
+UpdateBugs(World *world, WorkerPool *pool)
+{
+    world->time += SIM_TICK_SECONDS;
+    world->tick++;
+    int nChunks = (world->nBugs+BUG_CHUNK_SIZE-1)/BUG_CHUNK_SIZE;
+    RunParallel(pool, nChunks, UpdateBugChunk, world);
+    CollideBugs(world, pool);
+} 
+
+// Sphere around everything a loop's members can draw between two ticks,
+// from the member bounds of the last collision pass.
+internal inline b32
+IsLoopGroupInFrustum(Frustum *frustum, BugLoop *loop)
+{
+    if(loop->boundsMin.x > loop->boundsMax.x)
+    {
+        return 0;
+    }
+    r32 margin = BUG_CULL_MARGIN + 1.5f*loop->maxBugScale;
+    r32 halfX = 0.5f*(loop->boundsMax.x-loop->boundsMin.x) + margin;
+    r32 halfY = 0.5f*(loop->boundsMax.y-loop->boundsMin.y) + margin;
+    r32 halfZ = 0.5f*BUG_MAX_HEIGHT + margin;
+    Vec3 center = vec3(0.5f*(loop->boundsMin.x+loop->boundsMax.x),
+            0.5f*(loop->boundsMin.y+loop->boundsMax.y), 0.5f*BUG_MAX_HEIGHT);
+    return IsSphereInFrustum(frustum, center, sqrtf(halfX*halfX + halfY*halfY + halfZ*halfZ));
+}
+
+// Draws one bug at its interpolated position. Feet are moved along with the
+// body. The detail comes from the lod picked in the last tick.
+internal inline void
+EmitBug(World *world, Mesh *mesh, int bugIdx, Vec3 from, r32 alpha, r32 time)
+{
+    BugArrays *bugs = &world->bugs;
+    BugLod lod = bugs->lod[bugIdx];
+    r32 scale = bugs->scale[bugIdx];
+    if(lod==BUG_LOD_POINT)
     {
-        BugLoop *loopA = world->loops+loopAIdx;
-        for(int loopBIdx = loopAIdx+1;
-                loopBIdx < world->nLoops;
-                loopBIdx++)
+        r32 halfSize = 0.4*scale;
+        PushQuad(mesh, vec3(from.x-halfSize, from.y-halfSize, from.z),
+                vec3(from.x+halfSize, from.y-halfSize, from.z),
+                vec3(from.x+halfSize, from.y+halfSize, from.z),
+                vec3(from.x-halfSize, from.y+halfSize, from.z));
+        return;
+    }
+    r32 orientation = bugs->prevOrientation[bugIdx] + 
+        (bugs->orientation[bugIdx]-bugs->prevOrientation[bugIdx])*alpha;
+    r32 c, s;
+    SinCos(orientation, &c, &s);
+
+    // Draw Body
+    r32 lineWidth = scale*0.06;
+    Vec3 pos = vec3(bugs->x[bugIdx], bugs->y[bugIdx], bugs->z[bugIdx]);
+    Vec3 feetOffset = v3_sub(from, pos);
+    Vec3 to = v3_add(from, vec3(c*scale, s*scale, 0));
+    PushTrapezoid(mesh, from, to, 0.7*scale, 0.3*scale, vec3(0,0,1));
+    if(lod==BUG_LOD_BODY)
+    {
+        return;
+    }
+
+    // Draw antenna
+    r32 antennaTheta = time * 6;
+    r32 antennaMovement = 0.3;
+    r32 antSin, antCos;
+    SinCos(antennaTheta, &antSin, &antCos);
+    antCos = antCos*antennaMovement*scale;
+    antSin = antSin*antennaMovement*scale;
+    Vec3 antenna0 = v3_add(to, vec3(-scale*s*0.5 + antCos, scale*c*0.5+antSin, scale));
+    Vec3 antenna1 = v3_add(to, vec3(scale*s*0.5 -antSin, -scale*c*0.5+antCos, scale));
+    PushLine(mesh, to, antenna0, lineWidth, vec3(c,s,0));
+    PushLine(mesh, to, antenna1, lineWidth, vec3(c,s,0));
+
+    // Draw feet
+    Vec3 *feetFrom = bugs->feetFrom + bugIdx*6;
+    Vec3 *feetTo = bugs->feetTo + bugIdx*6;
+    for(int footIdx = 0;
+            footIdx < 6;
+            footIdx++)
+    {
+        PushLine(mesh, v3_add(feetFrom[footIdx], feetOffset), v3_add(feetTo[footIdx], feetOffset), 
+                lineWidth, vec3(0,0,1));
+    }
+}
+
+// Bug geometry for packed interleaved meshes, 4 bugs per pass. Body and
+// point quads are a template at scale 1 facing +x: a corner (forward, side)
+// of a bug with direction (c, s) is at from + scale*(forward*c - side*s,
+// forward*s + side*c). Antennae and legs are patched in per bug. Same
+// vertices and indices as EmitBug, in the same order.
+#define BUG_EMIT_BATCH 64
+#define BUG_QUADS 9
+#if defined(__SSE2__)
+global_variable r32 bugBodyTemplate[4][2] = {{0, 0.35f}, {0, -0.35f}, {1, -0.15f}, {1, 0.15f}};
+global_variable r32 bugPointTemplate[4][2] = {{-0.4f, 0.4f}, {-0.4f, -0.4f}, {0.4f, -0.4f}, {0.4f, 0.4f}};
+global_variable ui32 bugQuadIndices[6] = {0, 1, 2, 2, 3, 0};
+
+// A line of 4 bugs from from to to, with a normalized perp as in PushTrapezoid
+typedef struct
+{
+    __m128 x[4];
+    __m128 y[4];
+    __m128 z[4];
+} BugQuads4;
+
+internal inline void
+SetBugLine4(BugQuads4 *quad, __m128 fromX, __m128 fromY, __m128 fromZ, 
+        __m128 toX, __m128 toY, __m128 toZ, __m128 perpX, __m128 perpY, __m128 perpZ, __m128 halfWidth)
+{
+    __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(perpX, perpX), 
+                    _mm_mul_ps(perpY, perpY)), _mm_mul_ps(perpZ, perpZ)));
+    __m128 hasLength = _mm_cmpgt_ps(length, _mm_setzero_ps());
+    perpX = _mm_mul_ps(_mm_and_ps(hasLength, _mm_div_ps(perpX, length)), halfWidth);
+    perpY = _mm_mul_ps(_mm_and_ps(hasLength, _mm_div_ps(perpY, length)), halfWidth);
+    perpZ = _mm_mul_ps(_mm_and_ps(hasLength, _mm_div_ps(perpZ, length)), halfWidth);
+    quad->x[0] = _mm_sub_ps(fromX, perpX);
+    quad->y[0] = _mm_sub_ps(fromY, perpY);
+    quad->z[0] = _mm_sub_ps(fromZ, perpZ);
+    quad->x[1] = _mm_add_ps(fromX, perpX);
+    quad->y[1] = _mm_add_ps(fromY, perpY);
+    quad->z[1] = _mm_add_ps(fromZ, perpZ);
+    quad->x[2] = _mm_add_ps(toX, perpX);
+    quad->y[2] = _mm_add_ps(toY, perpY);
+    quad->z[2] = _mm_add_ps(toZ, perpZ);
+    quad->x[3] = _mm_sub_ps(toX, perpX);
+    quad->y[3] = _mm_sub_ps(toY, perpY);
+    quad->z[3] = _mm_sub_ps(toZ, perpZ);
+}
+
+// Up to 4 bugs, lanes past nBugs repeat the last bug and are not written.
+// The antenna wobble is the same for every bug.
+internal void
+EmitBugBatch4(World *world, Mesh *mesh, int *bugIdxs, Vec3 *froms, int nBugs, r32 alpha, 
+        r32 wobbleCos, r32 wobbleSin, ui32 color)
+{
+    BugArrays *bugs = &world->bugs;
+    r32 laneX[4], laneY[4], laneZ[4], laneOrientation[4], laneC[4], laneS[4], laneScale[4];
+    r32 laneOffsetX[4], laneOffsetY[4], laneOffsetZ[4];
+    r32 laneForward[4][4], laneSide[4][4];
+    int laneLod[4];
+    for(int lane = 0;
+            lane < 4;
+            lane++)
+    {
+        int batchIdx = lane < nBugs ? lane : nBugs-1;
+        int bugIdx = bugIdxs[batchIdx];
+        Vec3 from = froms[batchIdx];
+        laneLod[lane] = bugs->lod[bugIdx];
+        laneX[lane] = from.x;
+        laneY[lane] = from.y;
+        laneZ[lane] = from.z;
+        laneOffsetX[lane] = from.x-bugs->x[bugIdx];
+        laneOffsetY[lane] = from.y-bugs->y[bugIdx];
+        laneOffsetZ[lane] = from.z-bugs->z[bugIdx];
+        laneScale[lane] = bugs->scale[bugIdx];
+        r32 (*corners)[2] = bugBodyTemplate;
+        if(laneLod[lane]==BUG_LOD_POINT)
+        {
+            // Points are not turned
+            laneOrientation[lane] = 0;
+            corners = bugPointTemplate;
+        }
+        else
+        {
+            laneOrientation[lane] = bugs->prevOrientation[bugIdx] + 
+                (bugs->orientation[bugIdx]-bugs->prevOrientation[bugIdx])*alpha;
+        }
+        for(int corner = 0;
+                corner < 4;
+                corner++)
         {
-            BugLoop *loopB = world->loops+loopBIdx;
-            CollideLoops(world, loopA, loopB);
+            laneForward[corner][lane] = corners[corner][0];
+            laneSide[corner][lane] = corners[corner][1];
         }
     }
+    __m128 x = _mm_loadu_ps(laneX);
+    __m128 y = _mm_loadu_ps(laneY);
+    __m128 z = _mm_loadu_ps(laneZ);
+    __m128 c, s;
+    SinCos4(_mm_loadu_ps(laneOrientation), &c, &s);
+    _mm_storeu_ps(laneC, c);
+    _mm_storeu_ps(laneS, s);
+    __m128 scale = _mm_loadu_ps(laneScale);
+    __m128 zero = _mm_setzero_ps();
+    __m128 halfWidth = _mm_div_ps(_mm_mul_ps(scale, _mm_set1_ps(0.06f)), _mm_set1_ps(2));
+
+    // Body from the template, then 2 antennae and 6 legs
+    BugQuads4 quads[BUG_QUADS];
+    for(int corner = 0;
+            corner < 4;
+            corner++)
+    {
+        __m128 forward = _mm_loadu_ps(laneForward[corner]);
+        __m128 side = _mm_loadu_ps(laneSide[corner]);
+        quads[0].x[corner] = _mm_add_ps(x, _mm_mul_ps(scale, 
+                    _mm_sub_ps(_mm_mul_ps(forward, c), _mm_mul_ps(side, s))));
+        quads[0].y[corner] = _mm_add_ps(y, _mm_mul_ps(scale, 
+                    _mm_add_ps(_mm_mul_ps(forward, s), _mm_mul_ps(side, c))));
+        quads[0].z[corner] = z;
+    }
+
+    __m128 toX = _mm_add_ps(x, _mm_mul_ps(c, scale));
+    __m128 toY = _mm_add_ps(y, _mm_mul_ps(s, scale));
+    __m128 antCos = _mm_mul_ps(_mm_set1_ps(wobbleCos), scale);
+    __m128 antSin = _mm_mul_ps(_mm_set1_ps(wobbleSin), scale);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 tipX[2];
+    __m128 tipY[2];
+    tipX[0] = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(scale, s), _mm_set1_ps(-0.5f)), antCos);
+    tipY[0] = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(scale, c), half), antSin);
+    tipX[1] = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(scale, s), half), antSin);
+    tipY[1] = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(scale, c), _mm_set1_ps(-0.5f)), antCos);
+    for(int antenna = 0;
+            antenna < 2;
+            antenna++)
+    {
+        // Normal is the direction, perp = cross(tip-to, (c, s, 0))
+        __m128 tipToX = _mm_add_ps(toX, tipX[antenna]);
+        __m128 tipToY = _mm_add_ps(toY, tipY[antenna]);
+        __m128 tipToZ = _mm_add_ps(z, scale);
+        __m128 diffX = _mm_sub_ps(tipToX, toX);
+        __m128 diffY = _mm_sub_ps(tipToY, toY);
+        __m128 diffZ = _mm_sub_ps(tipToZ, z);
+        SetBugLine4(quads+1+antenna, toX, toY, z, tipToX, tipToY, tipToZ, 
+                _mm_sub_ps(zero, _mm_mul_ps(diffZ, s)), _mm_mul_ps(diffZ, c), 
+                _mm_sub_ps(_mm_mul_ps(diffX, s), _mm_mul_ps(diffY, c)), halfWidth);
+    }
+
+    __m128 offsetX = _mm_loadu_ps(laneOffsetX);
+    __m128 offsetY = _mm_loadu_ps(laneOffsetY);
+    __m128 offsetZ = _mm_loadu_ps(laneOffsetZ);
+    for(int footIdx = 0;
+            footIdx < 6;
+            footIdx++)
+    {
+        Vec3 footFrom[4];
+        Vec3 footTo[4];
+        for(int lane = 0;
+                lane < 4;
+                lane++)
+        {
+            int bugIdx = bugIdxs[lane < nBugs ? lane : nBugs-1];
+            footFrom[lane] = bugs->feetFrom[bugIdx*6+footIdx];
+            footTo[lane] = bugs->feetTo[bugIdx*6+footIdx];
+        }
+        __m128 fromX = _mm_add_ps(_mm_set_ps(footFrom[3].x, footFrom[2].x, footFrom[1].x, footFrom[0].x), offsetX);
+        __m128 fromY = _mm_add_ps(_mm_set_ps(footFrom[3].y, footFrom[2].y, footFrom[1].y, footFrom[0].y), offsetY);
+        __m128 fromZ = _mm_add_ps(_mm_set_ps(footFrom[3].z, footFrom[2].z, footFrom[1].z, footFrom[0].z), offsetZ);
+        __m128 legToX = _mm_add_ps(_mm_set_ps(footTo[3].x, footTo[2].x, footTo[1].x, footTo[0].x), offsetX);
+        __m128 legToY = _mm_add_ps(_mm_set_ps(footTo[3].y, footTo[2].y, footTo[1].y, footTo[0].y), offsetY);
+        __m128 legToZ = _mm_add_ps(_mm_set_ps(footTo[3].z, footTo[2].z, footTo[1].z, footTo[0].z), offsetZ);
+        // Normal is up, perp = cross(to-from, (0, 0, 1))
+        SetBugLine4(quads+3+footIdx, fromX, fromY, fromZ, legToX, legToY, legToZ, 
+                _mm_sub_ps(legToY, fromY), _mm_sub_ps(fromX, legToX), zero, halfWidth);
+    }
+
+    // Back to one vertex at a time for the stores
+    r32 quadX[BUG_QUADS][4][4], quadY[BUG_QUADS][4][4], quadZ[BUG_QUADS][4][4];
+    for(int quad = 0;
+            quad < BUG_QUADS;
+            quad++)
+    {
+        for(int corner = 0;
+                corner < 4;
+                corner++)
+        {
+            _mm_storeu_ps(quadX[quad][corner], quads[quad].x[corner]);
+            _mm_storeu_ps(quadY[quad][corner], quads[quad].y[corner]);
+            _mm_storeu_ps(quadZ[quad][corner], quads[quad].z[corner]);
+        }
+    }
+    Assert(mesh->nVertices + 4*4*BUG_QUADS < mesh->maxVertices);
+    Assert(mesh->nIndices + 4*6*BUG_QUADS < mesh->maxIndices);
+    ui32 up = PackNormal(vec3(0, 0, 1));
+    for(int lane = 0;
+            lane < nBugs;
+            lane++)
+    {
+        int nQuads = laneLod[lane]==BUG_LOD_FULL ? BUG_QUADS : 1;
+        ui32 direction = PackNormal(vec3(laneC[lane], laneS[lane], 0));
+        PackedVertex *vertex = (PackedVertex *)mesh->interleaved + mesh->nVertices;
+        ui32 *index = mesh->indices + mesh->nIndices;
+        for(int quad = 0;
+                quad < nQuads;
+                quad++)
+        {
+            ui32 normal = quad==1 || quad==2 ? direction : up;
+            for(int corner = 0;
+                    corner < 4;
+                    corner++)
+            {
+                vertex->x = quadX[quad][corner][lane];
+                vertex->y = quadY[quad][corner][lane];
+                vertex->z = quadZ[quad][corner][lane];
+                vertex->color = color;
+                vertex->normal = normal;
+                vertex++;
+            }
+            for(int quadIndex = 0;
+                    quadIndex < 6;
+                    quadIndex++)
+            {
+                *index++ = mesh->nVertices + quad*4 + bugQuadIndices[quadIndex];
+            }
+        }
+        mesh->nVertices+=4*nQuads;
+        mesh->nIndices+=6*nQuads;
+    }
+}
+
+internal void
+EmitBugBatch(World *world, Mesh *mesh, int *bugIdxs, Vec3 *froms, int nBugs, r32 alpha, 
+        r32 wobbleCos, r32 wobbleSin, ui32 color)
+{
+    for(int first = 0;
+            first < nBugs;
+            first+=4)
+    {
+        EmitBugBatch4(world, mesh, bugIdxs+first, froms+first, 
+                nBugs-first < 4 ? nBugs-first : 4, alpha, wobbleCos, wobbleSin, color);
+    }
+}
 #endif
-} 
 
+// Only reads bug state. Draws the bugs between the last two ticks, alpha 0 is
+// the previous tick. Loops are culled as a group first, the members of
+// visible loops are culled one by one.
+internal inline void
+EmitBugGeometry(World *world, Mesh *mesh, Frustum *frustum, r32 alpha, CullStats *stats)
+{
+    BugArrays *bugs = &world->bugs;
+    r32 time = world->time - (1-alpha)*SIM_TICK_SECONDS;
+#if defined(__SSE2__)
+    b32 isBatched = mesh->interleaved && mesh->format==VERTEX_FORMAT_PACKED;
+#else
+    b32 isBatched = 0;
+#endif
+    r32 wobbleSin, wobbleCos;
+    SinCos(time*6, &wobbleSin, &wobbleCos);
+    wobbleCos = wobbleCos*0.3f;
+    wobbleSin = wobbleSin*0.3f;
+    int batchBugs[BUG_EMIT_BATCH];
+    Vec3 batchFroms[BUG_EMIT_BATCH];
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        BugLoop *loop = world->loops+loopIdx;
+        if(!IsLoopGroupInFrustum(frustum, loop))
+        {
+            stats->bugsCulled+=loop->nBugs;
+            continue;
+        }
+        mesh->colorState = world->loopColors[loopIdx%8];
+        ui32 color = PackColor(mesh->colorState);
+        int nBatched = 0;
+        for(int memberIdx = 0;
+                memberIdx < loop->nBugs;
+                memberIdx++)
+        {
+            int bugIdx = loop->bugs[memberIdx];
+            Vec3 from = vec3(bugs->prevX[bugIdx] + (bugs->x[bugIdx]-bugs->prevX[bugIdx])*alpha,
+                    bugs->prevY[bugIdx] + (bugs->y[bugIdx]-bugs->prevY[bugIdx])*alpha,
+                    bugs->prevZ[bugIdx] + (bugs->z[bugIdx]-bugs->prevZ[bugIdx])*alpha);
+            if(!IsSphereInFrustum(frustum, from, 1.5f*bugs->scale[bugIdx] + 1))
+            {
+                stats->bugsCulled++;
+                continue;
+            }
+            stats->bugsDrawn++;
+            if(!isBatched)
+            {
+                EmitBug(world, mesh, bugIdx, from, alpha, time);
+                continue;
+            }
+            batchBugs[nBatched] = bugIdx;
+            batchFroms[nBatched] = from;
+            nBatched++;
+#if defined(__SSE2__)
+            if(nBatched==BUG_EMIT_BATCH)
+            {
+                EmitBugBatch(world, mesh, batchBugs, batchFroms, nBatched, alpha, 
+                        wobbleCos, wobbleSin, color);
+                nBatched = 0;
+            }
+#endif
+        }
+#if defined(__SSE2__)
+        EmitBugBatch(world, mesh, batchBugs, batchFroms, nBatched, alpha, 
+                wobbleCos, wobbleSin, color);
+#endif
+    }
+}
 
+// Fills the instance lists of the GPU bug path, culled like
+// EmitBugGeometry. The legs are animated in the shader from legPhase, which
+// goes round once per unit the bug moves forward.
+internal inline void
+EmitBugInstances(World *world, Frustum *frustum, r32 alpha, BugInstances *result, CullStats *stats)
+{
+    BugArrays *bugs = &world->bugs;
+    for(int lod = 0;
+            lod < BUG_LOD_COUNT;
+            lod++)
+    {
+        result->nInstances[lod] = 0;
+    }
+    for(int loopIdx = 0;
+            loopIdx < world->nLoops;
+            loopIdx++)
+    {
+        BugLoop *loop = world->loops+loopIdx;
+        if(!IsLoopGroupInFrustum(frustum, loop))
+        {
+            stats->bugsCulled+=loop->nBugs;
+            continue;
+        }
+        for(int memberIdx = 0;
+                memberIdx < loop->nBugs;
+                memberIdx++)
+        {
+            int bugIdx = loop->bugs[memberIdx];
+            Vec3 from = vec3(bugs->prevX[bugIdx] + (bugs->x[bugIdx]-bugs->prevX[bugIdx])*alpha,
+                    bugs->prevY[bugIdx] + (bugs->y[bugIdx]-bugs->prevY[bugIdx])*alpha,
+                    bugs->prevZ[bugIdx] + (bugs->z[bugIdx]-bugs->prevZ[bugIdx])*alpha);
+            if(!IsSphereInFrustum(frustum, from, 1.5f*bugs->scale[bugIdx] + 1))
+            {
+                stats->bugsCulled++;
+                continue;
+            }
+            stats->bugsDrawn++;
+            int lod = bugs->lod[bugIdx];
+            Assert(result->nInstances[lod] < result->maxInstances);
+            BugInstance *instance = result->instances[lod] + result->nInstances[lod]++;
+            instance->x = from.x;
+            instance->y = from.y;
+            instance->z = from.z;
+            instance->scale = bugs->scale[bugIdx];
+            instance->colorIndex = loopIdx%8;
+            instance->padding = 0;
+            if(lod==BUG_LOD_POINT)
+            {
+                // Points are not turned, same as the cpu path
+                instance->orientation = 0;
+                instance->legPhase = 0;
+            }
+            else
+            {
+                r32 orientation = bugs->prevOrientation[bugIdx] + 
+                    (bugs->orientation[bugIdx]-bugs->prevOrientation[bugIdx])*alpha;
+                r32 c, s;
+                SinCos(orientation, &c, &s);
+                r32 forward = from.x*c + from.y*s;
+                instance->orientation = orientation;
+                instance->legPhase = (ui16)((forward-floorf(forward))*65535.0f);
+            }
+        }
+    }
+}
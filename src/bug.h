@@ -1,39 +1,183 @@
 typedef struct BugLoop BugLoop;
-typedef struct Bug Bug;
 struct BugLoop
 {
     Vec3 pos;
     r32 radius;
+    Vec3 prevPos;       // state of the previous tick, for render interpolation
+    r32 prevRadius;
     r32 speedFactor;
     int nBugs;
-    Bug **bugs;
+    int maxBugs;
+    int *bugs;          // members in no particular order, see AppendBugToLoop
+
+    // Box around the members, grown by half the transfer distance. Updated
+    // in the bug pass and used by the loop broad phase.
+    Vec2 boundsMin;
+    Vec2 boundsMax;
+    r32 maxBugScale;
+    b32 hasContact;
 };
 
-struct Bug
+// The simulation always advances in ticks of this length, however fast the
+// frames are rendered.
+#define SIM_TICK_SECONDS (1.0f/60.0f)
+
+// Level of detail of a bug, picked every tick from the distance to the
+// viewer. Feet are only animated for bugs drawn with legs.
+typedef enum
 {
-    r32 orientation;
-    Vec3 pos;
-    r32 zVel;
-    r32 scale;
-    Vec3 feetFrom[6];
-    Vec3 feetTo[6];
-    int loopNumber;
-};
+    BUG_LOD_FULL,       // body, antennae and legs
+    BUG_LOD_BODY,       // body only
+    BUG_LOD_POINT,      // one small quad
+    BUG_LOD_COUNT,
+} BugLod;
+#define BUG_LOD_FULL_DISTANCE 60.0f
+#define BUG_LOD_BODY_DISTANCE 160.0f
+
+// Frustum culling of the bug geometry. Bugs jump up to about BUG_MAX_HEIGHT
+// and can move and change loop between the bounds update and the draw, which
+// BUG_CULL_MARGIN covers.
+#define BUG_MAX_HEIGHT 12.0f
+#define BUG_CULL_MARGIN 4.0f
+typedef struct
+{
+    int loopsDrawn;
+    int loopsCulled;
+    int bugsDrawn;
+    int bugsCulled;
+} CullStats;
+
+// Instances for the GPU bug path, one list per level of detail so each list
+// is drawn with the vertex count of its detail.
+typedef struct
+{
+    int maxInstances;
+    int nInstances[BUG_LOD_COUNT];
+    BugInstance *instances[BUG_LOD_COUNT];
+} BugInstances;
+
+// Bugs are stored as separate arrays so the per tick locomotion kernel only
+// streams through the fields it needs. All arrays are BUG_ALIGNMENT aligned
+// and padded to a multiple of BUG_SIMD_WIDTH.
+#define BUG_ALIGNMENT 64
+#define BUG_SIMD_WIDTH 4
+#define BUG_CHUNK_SIZE 1024     // bugs per worker task, keeps chunks cache line aligned
+typedef struct
+{
+    // Hot, touched every tick
+    r32 *x;
+    r32 *y;
+    r32 *z;
+    r32 *zVel;
+    r32 *orientation;
+    r32 *scale;
+    i32 *loopNumber;
+    i32 *loopSlot;      // index of the bug in the bugs list of its loop
+    ui8 *lod;           // BugLod
+
+    // Per tick scratch for the locomotion kernel
+    r32 *sinOrientation;
+    r32 *cosOrientation;
+    r32 *speedRoll;
+    r32 *steerRoll;
+
+    // State of the previous tick, for render interpolation
+    r32 *prevX;
+    r32 *prevY;
+    r32 *prevZ;
+    r32 *prevOrientation;
+
+    // One random stream per bug, so results do not depend on which thread
+    // updates the bug
+    RandomStreams random;
+
+    // Cold, 6 feet per bug. Only the leg animation touches these
+    Vec3 *feetFrom;
+    Vec3 *feetTo;
+} BugArrays;
+
+// Uniform grid over the world, rebuilt every tick with a counting sort. Bugs
+// closer than the cell size can only be in the same or a neighbouring cell.
+#define BUG_GRID_CELL_SIZE 2.0f
+typedef struct
+{
+    int width;
+    int height;
+    int *cellStart;     // width*height+1 offsets into cellBugs
+    int *cellBugs;      // bug indices sorted by cell
+    int *bugCell;
+    int *bugLoop;       // loop of each bug when the grid was built
+    int *loopBugCount;  // size of each loop when the grid was built
+} BugGrid;
+
+// A bug that has to move to another loop, found by the parallel collision
+// pass and applied afterwards on one thread.
+typedef struct
+{
+    ui64 order;         // cellBugs positions of the pair, the serial scan order
+    int bug;
+    int otherBug;       // bug joins the loop of this bug
+} TransferEvent;
+
+// Grid over the loop positions at the start of the loop pass, used by the
+// loop ai to find the nearest non-empty loop.
+#define LOOP_GRID_CELL_SIZE 16.0f
+typedef struct
+{
+    int width;
+    int height;
+    int *cellStart;
+    int *cellLoops;
+    int *loopCell;
+    Vec2 *loopPos;      // position of each loop when the grid was built
+} LoopGrid;
+
+// Member lists of loops are power of two blocks from the world arena. A block
+// that is outgrown goes into a free list of its size and is reused by the
+// next loop that grows into that size.
+#define LOOP_MIN_CAPACITY 16
+#define LOOP_CAPACITY_CLASSES 32
 
 typedef struct
 {
     r32 width;
     r32 height;
     r32 aiSpeed;
+    ui64 seed;
+    int nLoops;
+    int playerBugs;
+    int bugsPerLoop;
+    int maxBugs;        // limits for growth at runtime, 0 is the starting population
+    int maxLoops;
+} WorldConfig;
+
+typedef struct
+{
+    r32 width;
+    r32 height;
+    r32 aiSpeed;
+    r32 time;
+    ui32 tick;
+    b32 hasViewer;      // without a viewer every bug is at full detail
+    Vec3 viewerPos;
+    b32 animateFeet;    // only the cpu bug path draws legs from the feet
+    ui64 seed;
     int nBugs;
-    int maxBugs;
-    Bug *bugs;
+    int maxBugs;        // capacity of the bug arrays
+    int bugLimit;       // capacity can grow up to this
+    BugArrays bugs;
 
-    b32 isLoopDistributionDirty;
     int nLoops;
     int maxLoops;
+    int loopLimit;
     BugLoop *loops;
-    Bug **loopBugPointers;
+    MemoryArena *arena;
+    int *freeMemberBlocks[LOOP_CAPACITY_CLASSES];
+    int *loopSweepOrder;    // loops sorted on boundsMin.x, kept between ticks
+    int nLoopPairs;         // candidate pairs of the last broad phase
+    LoopGrid loopGrid;
+    BugGrid grid;
+    ui64 nTransfers;
 
     Vec3 loopColors[8];
 } World;
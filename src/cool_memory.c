@@ -26,4 +26,30 @@ PushMemory_(MemoryArena *arena, size_t size)
     return arena->base + arena->used - size;
 }
 #define PushStruct(arena, type) (type *)PushMemory_(arena, sizeof(type))
-#define PushArray(arena, type, nElements) (type *)PushMemory_(arena, sizeof(type)*nElements)
+#define PushArray(arena, type, nElements) (type *)PushMemory_(arena, sizeof(type)*(nElements))
+
+void *
+PushAlignedMemory_(MemoryArena *arena, size_t size, size_t alignment)
+{
+    size_t address = (size_t)(arena->base + arena->used);
+    size_t padding = (alignment - (address & (alignment-1))) & (alignment-1);
+    arena->used+=padding;
+    return PushMemory_(arena, size);
+}
+#define PushAlignedArray(arena, type, nElements, alignment) \
+    (type *)PushAlignedMemory_(arena, sizeof(type)*(nElements), alignment)
+
+// Moves an array into a new, bigger block of the arena. The old block is not
+// given back, so grow by doubling to waste at most the final size.
+void *
+ResizeAlignedMemory_(MemoryArena *arena, void *old, size_t oldSize, size_t newSize, size_t alignment)
+{
+    void *result = PushAlignedMemory_(arena, newSize, alignment);
+    if(old)
+    {
+        memcpy(result, old, oldSize);
+    }
+    return result;
+}
+#define ResizeAlignedArray(arena, array, oldCount, newCount, alignment) \
+    ResizeAlignedMemory_(arena, array, sizeof(*(array))*(oldCount), sizeof(*(array))*(newCount), alignment)
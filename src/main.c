@@ -1,5 +1,10 @@
 #include "external_headers.h"
 #include <time.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define DebugOut(args...) printf(args); printf("\t\t %s:%d\n", __FILE__, __LINE__)
 #define Assert(expr) if(!(expr)) {DebugOut("assert failed "#expr""); \
@@ -12,38 +17,49 @@
 typedef unsigned char ui8;
 typedef unsigned short ui16;
 typedef unsigned int ui32;
-typedef unsigned long ui64;
+typedef unsigned long long ui64;
 typedef char i8;
 typedef short i16;
 typedef int i32;
-typedef long i64;
+typedef long long i64;
 
 typedef float r32;
 typedef double r64;
 
 typedef i32 b32;
 
+// Worker deque ranges, transfer order keys and the random hashes pack two 32
+// bit values into one ui64
+_Static_assert(sizeof(ui64)==8, "ui64 has to be 64 bits");
+
 #define MAX_VERTEX_MEMORY 512*1024
 #define MAX_ELEMENT_MEMORY 128*1024
 
 // Own files
 #include "cool_memory.h"
 #include "tims_math.h"
+#include "random.h"
+#include "worker_pool.h"
 #include "app_state.h"
 #include "renderer.h"
+#include "terrain.h"
 #include "bug.h"
 
 #include "cool_memory.c"
 #include "tims_math.c"
+#include "random.c"
+#include "worker_pool.c"
 #include "app_state.c"
 #include "renderer.c"
+#include "terrain.c"
 #include "bug.c"
 
 // shaders
 #include "shaderVert.h"
 #include "shaderFrag.h"
+#include "shaderBugVert.h"
 
-#define FRAMES_PER_SECOND 60
+#define SIM_MAX_TICKS_PER_FRAME 5
 
 const char *
 ReadEntireFile(char *path)
@@ -136,19 +152,79 @@ void data_callback(ma_device *pDevice, void *pOutput, const void *pInput, ma_uin
     (void)pInput;
 }
 
+internal WorldConfig
+DefaultWorldConfig(r32 aiSpeed, ui64 seed)
+{
+    WorldConfig config = {};
+    config.seed = seed;
+    config.width = 500;
+    config.height = 320;
+    config.aiSpeed = aiSpeed;
+    config.nLoops = 32;
+    config.playerBugs = 50;
+    config.bugsPerLoop = 30;
+    return config;
+}
+
+internal int
+GetWorldStartBugs(WorldConfig *config)
+{
+    return config->playerBugs + (config->nLoops-1)*config->bugsPerLoop;
+}
+
+internal int
+GetWorldMaxBugs(WorldConfig *config)
+{
+    int startBugs = GetWorldStartBugs(config);
+    return config->maxBugs > startBugs ? config->maxBugs : startBugs;
+}
+
+internal int
+GetWorldMaxLoops(WorldConfig *config)
+{
+    return config->maxLoops > config->nLoops ? config->maxLoops : config->nLoops;
+}
+
+// Rough upper bound of the arena memory SetupWorld needs for this config,
+// including growth up to the limits. Growing by doubling allocates less than
+// three times the final size in total.
+internal size_t
+GetWorldMemorySize(WorldConfig *config)
+{
+    size_t maxBugs = GetWorldMaxBugs(config);
+    size_t maxLoops = GetWorldMaxLoops(config);
+    size_t bytesPerBug = 15*sizeof(r32) + 12*sizeof(Vec3) + 10*sizeof(int);
+    size_t bytesPerLoop = sizeof(BugLoop) + 5*sizeof(int) + sizeof(Vec2);
+    size_t gridBytes = (size_t)(config->width/BUG_GRID_CELL_SIZE+2)*
+        (config->height/BUG_GRID_CELL_SIZE+2)*sizeof(int);
+    return sizeof(World) + 3*(maxLoops*bytesPerLoop + maxBugs*bytesPerBug) + 
+        GetLoopMemberMemorySize(maxLoops, maxBugs) + 2*gridBytes + 256*BUG_ALIGNMENT;
+}
+
 void
-SetupWorld(MemoryArena *arena, World *world, r32 aiSpeed)
+SetupWorld(MemoryArena *arena, World *world, WorldConfig *config)
 {
     // Creating the world
-    world->width = 500;
-    world->height = 320;
+    world->seed = config->seed;
+    SeedThreadRandom(config->seed);
+    world->width = config->width;
+    world->height = config->height;
+    world->aiSpeed = config->aiSpeed;
+    world->animateFeet = 0;
+    world->arena = arena;
+    memset(world->freeMemberBlocks, 0, sizeof(world->freeMemberBlocks));
+    InitBugGrid(arena, &world->grid, world->width, world->height);
+    InitLoopGrid(arena, &world->loopGrid, world->width, world->height);
+
+    // Room for the starting population, the tables grow when needed
     world->nBugs = 0;
-    world->maxBugs = 1200;
-    world->bugs = PushArray(arena, Bug, world->maxBugs);
-    world->maxLoops = 32;
-    world->aiSpeed = aiSpeed;
-    world->loops = PushArray(arena, BugLoop, world->maxLoops);
-    world->loopBugPointers = PushArray(arena, Bug*, world->maxBugs);
+    world->maxBugs = 0;
+    world->bugLimit = GetWorldMaxBugs(config);
+    GrowBugCapacity(world, GetWorldStartBugs(config));
+    world->nLoops = 0;
+    world->maxLoops = 0;
+    world->loopLimit = GetWorldMaxLoops(config);
+    GrowLoopCapacity(world, config->nLoops);
     world->loopColors[0] = ARGBToVec3(0xffff0000);
     world->loopColors[1] = ARGBToVec3(0xff006400);
     world->loopColors[2] = ARGBToVec3(0xff191970);
@@ -157,32 +233,29 @@ SetupWorld(MemoryArena *arena, World *world, r32 aiSpeed)
     world->loopColors[5] = ARGBToVec3(0xff00ffff);
     world->loopColors[6] = ARGBToVec3(0xffff00ff);
     world->loopColors[7] = ARGBToVec3(0xffffb6c1);
-    world->isLoopDistributionDirty = 1;
-    int nLoops = 32;
     for(int loopN = 0;
-            loopN < nLoops;
+            loopN < config->nLoops;
             loopN++)
     {
-        AddLoop(arena, world);
-        int nBugsInLoop = loopN == 0 ? 50 : 30;
+        AddLoop(world);
+        int nBugsInLoop = loopN == 0 ? config->playerBugs : config->bugsPerLoop;
         for(int bugIdx = 0;
                 bugIdx < nBugsInLoop;
                 bugIdx++)
         {
-            Bug *bug = AddBug(world, loopN);
+            AddBug(world, loopN);
         }
     }
+    // Frames that run no tick still cull against the loop bounds
+    UpdateLoopBounds(world);
 }
 
+// The ground itself is the Terrain, this is what stands on it
 void 
 SetupWorldMesh(World *world, Mesh *mesh)
 {
     ClearMesh(mesh);
-    r32 tileSize = 10;
-    int xTiles = (int)(world->width/tileSize);
-    int yTiles = (int)(world->height/tileSize);
     mesh->colorState = ARGBToVec3(0xff5cf508);
-    PushHeightField(mesh, tileSize, xTiles+1, yTiles+1);
     int nCactus = 5;
     for(int i = 0; i < nCactus; i++)
     {
@@ -192,19 +265,413 @@ SetupWorldMesh(World *world, Mesh *mesh)
 }
 
 void 
-ResetWorld(MemoryArena *arena, World **world, Mesh *groundMesh, Model *groundModel, r32 aiSpeed)
+ResetWorld(MemoryArena *arena, World **world, Mesh *groundMesh, Model *groundModel, 
+        Terrain *terrain, r32 aiSpeed, ui64 seed)
 {
     ClearArena(arena);
     *world = PushStruct(arena, World);
-    SetupWorld(arena, *world, aiSpeed);
+    WorldConfig config = DefaultWorldConfig(aiSpeed, seed);
+    SetupWorld(arena, *world, &config);
     ClearMesh(groundMesh);
     SetupWorldMesh(*world, groundMesh);
     SetModelFromMesh(groundModel, groundMesh, GL_STATIC_DRAW);
+    ResetTerrain(terrain, seed);
+}
+
+internal r64
+GetSecondsElapsed(ui64 start, ui64 end)
+{
+    return ((r64)(end-start))/((r64)SDL_GetPerformanceFrequency());
+}
+
+internal int
+CompareR64(const void *a, const void *b)
+{
+    r64 x = *(r64 *)a;
+    r64 y = *(r64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Runs the bug simulation without window, gl context or gui and prints timings.
+int
+RunHeadlessSimulation(LaunchOptions *options)
+{
+    int nTicks = options->nTicks > 0 ? options->nTicks : 1;
+    WorldConfig config = DefaultWorldConfig(1.0, options->hasSeed ? options->seed : 1);
+    if(options->bugsPerLoop > 0)
+    {
+        config.bugsPerLoop = options->bugsPerLoop;
+        config.playerBugs = options->bugsPerLoop;
+    }
+    if(options->nLoops > 0)
+    {
+        config.nLoops = options->nLoops;
+    }
+    config.maxBugs = options->maxBugs;
+    config.maxLoops = options->maxLoops;
+    MemoryArena *gameArena = CreateMemoryArena(GetWorldMemorySize(&config));
+    World *world = PushStruct(gameArena, World);
+    SetupWorld(gameArena, world, &config);
+    MemoryArena *platformArena = CreateMemoryArena(1024*1024);
+    WorkerPool *pool = CreateWorkerPool(platformArena, 
+            options->nThreads > 0 ? options->nThreads : SDL_GetCPUCount());
+    r64 *tickTimes = (r64 *)malloc(sizeof(r64)*nTicks);
+
+    ui64 simStart = SDL_GetPerformanceCounter();
+    for(int tick = 0;
+            tick < nTicks;
+            tick++)
+    {
+        ui64 tickStart = SDL_GetPerformanceCounter();
+        for(int spawnIdx = 0;
+                spawnIdx < options->spawnPerTick && world->nBugs < world->bugLimit;
+                spawnIdx++)
+        {
+            AddBug(world, (tick+spawnIdx)%world->nLoops);
+        }
+        for(int despawnIdx = 0;
+                despawnIdx < options->despawnPerTick && world->nBugs > 0;
+                despawnIdx++)
+        {
+            RemoveBug(world, (int)(((ui64)tick*7919 + despawnIdx*104729) % world->nBugs));
+        }
+        UpdateLoops(world);
+        UpdateBugs(world, pool);
+        tickTimes[tick] = GetSecondsElapsed(tickStart, SDL_GetPerformanceCounter());
+    }
+    r64 totalTime = GetSecondsElapsed(simStart, SDL_GetPerformanceCounter());
+
+    qsort(tickTimes, nTicks, sizeof(r64), CompareR64);
+    int p99Idx = (int)(nTicks*0.99);
+    if(p99Idx >= nTicks) p99Idx = nTicks-1;
+    printf("ticks            : %d\n", nTicks);
+    printf("bugs             : %d in %d loops\n", world->nBugs, world->nLoops);
+    printf("threads          : %d\n", pool->nThreads);
+    printf("ticks per second : %.1f\n", nTicks/totalTime);
+    printf("average tick     : %.4f ms\n", 1000.0*totalTime/nTicks);
+    printf("p99 tick         : %.4f ms\n", 1000.0*tickTimes[p99Idx]);
+    printf("bugs transferred : %llu\n", world->nTransfers);
+
+    DestroyWorkerPool(pool);
+    free(tickTimes);
+    free(gameArena);
+    free(platformArena);
+    return 0;
+}
+
+// Fills the mesh with nVertices vertices of bug sized lines
+internal void
+PushBenchmarkLines(Mesh *mesh, int nVertices)
+{
+    ClearMesh(mesh);
+    for(int lineIdx = 0;
+            lineIdx < nVertices/4;
+            lineIdx++)
+    {
+        r32 x = (r32)(lineIdx%317);
+        r32 y = (r32)(lineIdx%211);
+        mesh->colorState = vec3(x/317.0f, y/211.0f, 0.5f);
+        PushLine(mesh, vec3(x, y, 0), vec3(x+0.5f, y+0.3f, 1), 0.06f, vec3(0,0,1));
+    }
+}
+
+// Cpu side cost of getting a mesh into the vertex buffer layout, with and
+// without the repack in SetModelFromMesh, and in the packed format. Then the
+// cost of the bug geometry of the cpu bug path. Needs no gl context.
+int
+RunMeshBenchmark(LaunchOptions *options)
+{
+    int nVertices = options->nBenchVertices > 0 ? options->nBenchVertices : 100000;
+    int nRuns = 50;
+    // Lines use 6 indices per 4 vertices, meshes have as many indices as vertices
+    int meshSize = 2*nVertices;
+    MemoryArena *arena = CreateMemoryArena((size_t)meshSize*(3*MESH_STRIDE*sizeof(r32) + 
+                MESH_STRIDE*sizeof(r32) + sizeof(PackedVertex) + 4*sizeof(ui32)) + 1024*1024);
+    Mesh *separateMesh = CreateMesh(arena, meshSize);
+    Mesh *interleavedMesh = CreateInterleavedMesh(arena, meshSize, VERTEX_FORMAT_FLOAT);
+    Mesh *packedMesh = CreateInterleavedMesh(arena, meshSize, VERTEX_FORMAT_PACKED);
+    ui8 *vertexBuffer = PushArray(arena, ui8, (size_t)meshSize*MESH_STRIDE*sizeof(r32));
+    ui32 *indexBuffer = PushArray(arena, ui32, meshSize);
+    r64 *separateTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *interleavedTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *packedTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    int bufferBytes = 0;
+
+    for(int run = 0;
+            run < nRuns;
+            run++)
+    {
+        ui64 start = SDL_GetPerformanceCounter();
+        PushBenchmarkLines(separateMesh, nVertices);
+        bufferBytes = PackMeshVertices(vertexBuffer, separateMesh, VERTEX_FORMAT_FLOAT);
+        memcpy(indexBuffer, separateMesh->indices, separateMesh->nIndices*sizeof(ui32));
+        separateTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        PushBenchmarkLines(interleavedMesh, nVertices);
+        interleavedTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        PushBenchmarkLines(packedMesh, nVertices);
+        packedTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+    }
+    Assert(!memcmp(vertexBuffer, interleavedMesh->interleaved, bufferBytes));
+
+    qsort(separateTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(interleavedTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(packedTimes, nRuns, sizeof(r64), CompareR64);
+    int nMeshVertices = separateMesh->nVertices;
+    printf("vertices         : %d, %d runs\n", nMeshVertices, nRuns);
+    printf("push + repack    : %.4f ms median, %.4f ms best, %d bytes\n", 
+            1000.0*separateTimes[nRuns/2], 1000.0*separateTimes[0], 
+            nMeshVertices*GetVertexSize(VERTEX_FORMAT_FLOAT));
+    printf("push interleaved : %.4f ms median, %.4f ms best, %d bytes\n", 
+            1000.0*interleavedTimes[nRuns/2], 1000.0*interleavedTimes[0], 
+            nMeshVertices*GetVertexSize(VERTEX_FORMAT_FLOAT));
+    printf("push packed      : %.4f ms median, %.4f ms best, %d bytes\n", 
+            1000.0*packedTimes[nRuns/2], 1000.0*packedTimes[0], 
+            nMeshVertices*GetVertexSize(VERTEX_FORMAT_PACKED));
+
+    // Bug geometry of a running world, one primitive at a time against the
+    // batched template, into the same packed mesh
+    WorldConfig config = DefaultWorldConfig(1.0, 1);
+    config.bugsPerLoop = options->bugsPerLoop > 0 ? options->bugsPerLoop : 300;
+    config.playerBugs = config.bugsPerLoop;
+    MemoryArena *gameArena = CreateMemoryArena(GetWorldMemorySize(&config));
+    World *world = PushStruct(gameArena, World);
+    SetupWorld(gameArena, world, &config);
+    world->animateFeet = 1;
+    MemoryArena *platformArena = CreateMemoryArena(1024*1024);
+    WorkerPool *pool = CreateWorkerPool(platformArena, SDL_GetCPUCount());
+    for(int tick = 0;
+            tick < 10;
+            tick++)
+    {
+        UpdateLoops(world);
+        UpdateBugs(world, pool);
+    }
+    int bugMeshSize = world->nBugs*6*BUG_QUADS + 1024;
+    MemoryArena *bugArena = CreateMemoryArena(2*(size_t)bugMeshSize*(sizeof(PackedVertex)+sizeof(ui32)) + 1024);
+    Mesh *primitiveMesh = CreateInterleavedMesh(bugArena, bugMeshSize, VERTEX_FORMAT_PACKED);
+    Mesh *batchedMesh = CreateInterleavedMesh(bugArena, bugMeshSize, VERTEX_FORMAT_PACKED);
+    Mat4 everything = m4_ortho(-1, world->width+1, -1, world->height+1, -1000, 1000);
+    Frustum frustum = ExtractFrustum(&everything);
+    r32 alpha = 0.5f;
+    r32 time = world->time - (1-alpha)*SIM_TICK_SECONDS;
+    CullStats cullStats = {};
+    for(int run = 0;
+            run < nRuns;
+            run++)
+    {
+        ui64 start = SDL_GetPerformanceCounter();
+        ClearMesh(primitiveMesh);
+        for(int loopIdx = 0;
+                loopIdx < world->nLoops;
+                loopIdx++)
+        {
+            BugLoop *loop = world->loops+loopIdx;
+            primitiveMesh->colorState = world->loopColors[loopIdx%8];
+            for(int memberIdx = 0;
+                    memberIdx < loop->nBugs;
+                    memberIdx++)
+            {
+                int bugIdx = loop->bugs[memberIdx];
+                BugArrays *bugs = &world->bugs;
+                Vec3 from = vec3(bugs->prevX[bugIdx] + (bugs->x[bugIdx]-bugs->prevX[bugIdx])*alpha,
+                        bugs->prevY[bugIdx] + (bugs->y[bugIdx]-bugs->prevY[bugIdx])*alpha,
+                        bugs->prevZ[bugIdx] + (bugs->z[bugIdx]-bugs->prevZ[bugIdx])*alpha);
+                EmitBug(world, primitiveMesh, bugIdx, from, alpha, time);
+            }
+        }
+        separateTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        ClearMesh(batchedMesh);
+        cullStats = (CullStats){};
+        EmitBugGeometry(world, batchedMesh, &frustum, alpha, &cullStats);
+        packedTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+    }
+    Assert(cullStats.bugsDrawn==world->nBugs);
+    Assert(primitiveMesh->nVertices==batchedMesh->nVertices);
+    Assert(!memcmp(primitiveMesh->indices, batchedMesh->indices, batchedMesh->nIndices*sizeof(ui32)));
+    r32 maxDifference = 0;
+    for(int vertexIdx = 0;
+            vertexIdx < batchedMesh->nVertices;
+            vertexIdx++)
+    {
+        PackedVertex *a = (PackedVertex *)primitiveMesh->interleaved + vertexIdx;
+        PackedVertex *b = (PackedVertex *)batchedMesh->interleaved + vertexIdx;
+        Assert(a->color==b->color && a->normal==b->normal);
+        maxDifference = fmaxf(maxDifference, fmaxf(fabsf(a->x-b->x), 
+                    fmaxf(fabsf(a->y-b->y), fabsf(a->z-b->z))));
+    }
+    qsort(separateTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(packedTimes, nRuns, sizeof(r64), CompareR64);
+    printf("bugs             : %d, %d vertices\n", world->nBugs, batchedMesh->nVertices);
+    printf("bugs primitives  : %.4f ms median, %.4f ms best\n", 
+            1000.0*separateTimes[nRuns/2], 1000.0*separateTimes[0]);
+    printf("bugs batched     : %.4f ms median, %.4f ms best, max difference %g\n", 
+            1000.0*packedTimes[nRuns/2], 1000.0*packedTimes[0], maxDifference);
+
+    DestroyWorkerPool(pool);
+    free(bugArena);
+    free(platformArena);
+    free(gameArena);
+    free(separateTimes);
+    free(interleavedTimes);
+    free(packedTimes);
+    free(arena);
+    return 0;
+}
+
+// SinCos and SinCosFill against sinf and cosf, and the unit circle table
+// against computing the points. Needs no gl context.
+int
+RunMathBenchmark(LaunchOptions *options)
+{
+    int nAngles = 1 << 20;
+    int nRuns = 50;
+    MemoryArena *arena = CreateMemoryArena(3*nAngles*sizeof(r32) + 1024);
+    r32 *angles = PushAlignedArray(arena, r32, nAngles, 16);
+    r32 *sins = PushAlignedArray(arena, r32, nAngles, 16);
+    r32 *coses = PushAlignedArray(arena, r32, nAngles, 16);
+    RandomSeries series = SeedRandomSeries(options->hasSeed ? options->seed : 1);
+    for(int angleIdx = 0;
+            angleIdx < nAngles;
+            angleIdx++)
+    {
+        angles[angleIdx] = RandomBetween(&series, -8*M_PI, 8*M_PI);
+    }
+    r64 *libmTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *scalarTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *fillTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *computedCircleTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    r64 *tableCircleTimes = (r64 *)malloc(sizeof(r64)*nRuns);
+    int nCircles = 10000;
+    int nCirclePoints = 20;
+    r32 circleSum = 0;
+
+    for(int run = 0;
+            run < nRuns;
+            run++)
+    {
+        ui64 start = SDL_GetPerformanceCounter();
+        for(int angleIdx = 0;
+                angleIdx < nAngles;
+                angleIdx++)
+        {
+            sins[angleIdx] = sinf(angles[angleIdx]);
+            coses[angleIdx] = cosf(angles[angleIdx]);
+        }
+        libmTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        for(int angleIdx = 0;
+                angleIdx < nAngles;
+                angleIdx++)
+        {
+            SinCos(angles[angleIdx], sins+angleIdx, coses+angleIdx);
+        }
+        scalarTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        SinCosFill(angles, 0, nAngles, sins, coses);
+        fillTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        // The points of PushLineCircle, the sum keeps the loops from being
+        // optimized away
+        start = SDL_GetPerformanceCounter();
+        for(int circle = 0;
+                circle < nCircles;
+                circle++)
+        {
+            for(int point = 0;
+                    point < nCirclePoints;
+                    point++)
+            {
+                r32 angle = point * (M_PI*2.0 / (nCirclePoints-1));
+                circleSum+=cosf(angle)*circle + sinf(angle);
+            }
+        }
+        computedCircleTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+
+        start = SDL_GetPerformanceCounter();
+        for(int circle = 0;
+                circle < nCircles;
+                circle++)
+        {
+            Vec2 *points = GetUnitCircle(nCirclePoints);
+            for(int point = 0;
+                    point < nCirclePoints;
+                    point++)
+            {
+                circleSum-=points[point].x*circle + points[point].y;
+            }
+        }
+        tableCircleTimes[run] = GetSecondsElapsed(start, SDL_GetPerformanceCounter());
+    }
+
+    r64 maxError = 0;
+    for(int angleIdx = 0;
+            angleIdx < nAngles;
+            angleIdx++)
+    {
+        r64 sinError = fabs(sins[angleIdx] - sin((r64)angles[angleIdx]));
+        r64 cosError = fabs(coses[angleIdx] - cos((r64)angles[angleIdx]));
+        maxError = fmax(maxError, fmax(sinError, cosError));
+    }
+    r64 libmError = 0;
+    for(int angleIdx = 0;
+            angleIdx < nAngles;
+            angleIdx++)
+    {
+        r64 sinError = fabs(sinf(angles[angleIdx]) - sin((r64)angles[angleIdx]));
+        r64 cosError = fabs(cosf(angles[angleIdx]) - cos((r64)angles[angleIdx]));
+        libmError = fmax(libmError, fmax(sinError, cosError));
+    }
+
+    qsort(libmTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(scalarTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(fillTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(computedCircleTimes, nRuns, sizeof(r64), CompareR64);
+    qsort(tableCircleTimes, nRuns, sizeof(r64), CompareR64);
+    printf("angles           : %d in [-8pi, 8pi], %d runs\n", nAngles, nRuns);
+    printf("sinf + cosf      : %.4f ms median, %.2f ns per angle, max error %.3g\n", 
+            1000.0*libmTimes[nRuns/2], 1e9*libmTimes[nRuns/2]/nAngles, libmError);
+    printf("SinCos           : %.4f ms median, %.2f ns per angle\n", 
+            1000.0*scalarTimes[nRuns/2], 1e9*scalarTimes[nRuns/2]/nAngles);
+    printf("SinCosFill       : %.4f ms median, %.2f ns per angle, max error %.3g\n", 
+            1000.0*fillTimes[nRuns/2], 1e9*fillTimes[nRuns/2]/nAngles, maxError);
+    printf("circle computed  : %.4f ms median for %d circles of %d points\n", 
+            1000.0*computedCircleTimes[nRuns/2], nCircles, nCirclePoints);
+    printf("circle table     : %.4f ms median (%g)\n", 
+            1000.0*tableCircleTimes[nRuns/2], circleSum);
+
+    free(libmTimes);
+    free(scalarTimes);
+    free(fillTimes);
+    free(computedCircleTimes);
+    free(tableCircleTimes);
+    free(arena);
+    return 0;
 }
 
 int 
 main(int argc, char**argv)
 {
+    LaunchOptions options = ParseLaunchOptions(argc, argv);
+    if(options.headless)
+    {
+        return RunHeadlessSimulation(&options);
+    }
+    if(options.benchMesh)
+    {
+        return RunMeshBenchmark(&options);
+    }
+    if(options.benchMath)
+    {
+        return RunMathBenchmark(&options);
+    }
 
 #if 0
     // Audio setup 
@@ -241,7 +708,7 @@ main(int argc, char**argv)
         DebugOut("Does not work\n");
     }
 
-    srand(time(0));
+    ui64 seed = options.hasSeed ? options.seed : (ui64)time(0);
 
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -282,6 +749,14 @@ main(int argc, char**argv)
     ui32 transformLocation = glGetUniformLocation(simpleShader, "transform");
     ui32 lightDirLocation = glGetUniformLocation(simpleShader, "lightDir");
 
+    const char *const bugVertSource = (const char *)shaders_bug_vert;
+    ui32 bugVertexShader = CreateAndCompileShaderSource(&bugVertSource, GL_VERTEX_SHADER);
+    ui32 bugShader = CreateAndLinkShaderProgram(fragmentShader, bugVertexShader);
+    ui32 bugTransformLocation = glGetUniformLocation(bugShader, "transform");
+    ui32 bugLoopColorsLocation = glGetUniformLocation(bugShader, "loopColors");
+    ui32 bugTimeLocation = glGetUniformLocation(bugShader, "time");
+    ui32 bugPointModeLocation = glGetUniformLocation(bugShader, "pointMode");
+
     r32 tSize = 0.5;
     r32 vertices[] = {-tSize, -tSize, 0.0,
     tSize, -tSize, 0.0,
@@ -312,9 +787,8 @@ main(int argc, char**argv)
 
     r32 time = 0.0;
     r32 deltaTime = 0.0;
-    r32 timeSinceLastFrame = 0.0;
-    r32 updateTime = 1.0/FRAMES_PER_SECOND;
-    ui32 frameStart = SDL_GetTicks(); 
+    r32 tickAccumulator = 0.0;
+    ui64 frameStart = SDL_GetPerformanceCounter(); 
     // Timing
     b32 done = 0;
     ui32 frameCounter = 0;
@@ -324,23 +798,47 @@ main(int argc, char**argv)
     Camera camera;
     InitCamera(&camera);
     camera.lookAt = vec3(10,10,0);
+    UpdateCamera(&camera, screen_width, screen_height);
 
     MemoryArena *gameArena = CreateMemoryArena(1024*1024*20);
     MemoryArena *renderArena = CreateMemoryArena(1024*1024*20);
+    MemoryArena *platformArena = CreateMemoryArena(1024*1024);
+    WorkerPool *pool = CreateWorkerPool(platformArena, 
+            options.nThreads > 0 ? options.nThreads : SDL_GetCPUCount());
 
     World *world = PushStruct(gameArena, World);
-    SetupWorld(gameArena, world, aiSpeed);
+    WorldConfig config = DefaultWorldConfig(aiSpeed, seed);
+    SetupWorld(gameArena, world, &config);
 
     Model *groundModel = PushStruct(renderArena, Model);
-    Mesh *groundMesh = CreateMesh(renderArena, 20000);
-    InitModel(gameArena, groundModel, 20000);
+    Mesh *groundMesh = CreateInterleavedMesh(renderArena, 20000, VERTEX_FORMAT_PACKED);
+    InitModel(renderArena, groundModel, 20000, VERTEX_FORMAT_PACKED);
+    Terrain *terrain = PushStruct(renderArena, Terrain);
+    InitTerrain(renderArena, terrain, world->width, world->height, 
+            options.flatGround ? HEIGHTFIELD_FLAT : HEIGHTFIELD_SMOOTH, options.groundCache);
+    ResetTerrain(terrain, seed);
 
     SetupWorldMesh(world, groundMesh);
     SetModelFromMesh(groundModel, groundMesh, GL_STATIC_DRAW);
+    DebugOut("ground : %d by %d chunks", terrain->nChunksX, terrain->nChunksY);
 
-    Mesh *dynamicMesh = CreateMesh(renderArena, 100000);
+    Mesh *dynamicMesh = PushStruct(renderArena, Mesh);
+    InitStreamingMesh(dynamicMesh);
     Model *dynamicModel = PushStruct(renderArena, Model);
-    InitModel(gameArena, dynamicModel, 100000);
+    InitStreamingModel(dynamicModel, 100000, VERTEX_FORMAT_PACKED);
+    r64 uploadTime = 0;
+
+    // One list per detail, each can hold every bug
+    BugInstances *bugInstances = PushStruct(renderArena, BugInstances);
+    bugInstances->maxInstances = GetWorldMaxBugs(&config);
+    for(int lod = 0;
+            lod < BUG_LOD_COUNT;
+            lod++)
+    {
+        bugInstances->instances[lod] = PushArray(renderArena, BugInstance, bugInstances->maxInstances);
+    }
+    BugInstanceModel *bugInstanceModel = PushStruct(renderArena, BugInstanceModel);
+    InitBugInstanceModel(bugInstanceModel, bugInstances->maxInstances);
 
     DebugOut("%d bugs", world->nBugs);
     BugLoop *playerLoop = world->loops;
@@ -356,6 +854,8 @@ main(int argc, char**argv)
 
     while(!done)
     {
+        // The loop table moves when it grows
+        playerLoop = world->loops;
         SDL_Event event;
         nk_input_begin(ctx);
         ResetKeyActions(appState);
@@ -396,6 +896,82 @@ main(int argc, char**argv)
         SDL_GetWindowSize(window, &appState->screenWidth, &appState->screenHeight);
         appState->ratio = (r32)appState->screenHeight / ((r32)appState->screenWidth);
 
+        // Fixed timestep. Runs the ticks the elapsed time asks for, at most
+        // SIM_MAX_TICKS_PER_FRAME, and draws between the last two ticks.
+        ui64 frameEnd = SDL_GetPerformanceCounter();
+        deltaTime = GetSecondsElapsed(frameStart, frameEnd);
+        frameStart = frameEnd;
+        time+=deltaTime;
+        tickAccumulator+=deltaTime;
+        int nTicks = 0;
+        // Bug detail follows the camera of the last frame
+        world->hasViewer = 1;
+        world->viewerPos = camera.pos;
+        world->animateFeet = options.cpuBugs;
+        while(tickAccumulator >= SIM_TICK_SECONDS && nTicks < SIM_MAX_TICKS_PER_FRAME)
+        {
+            UpdateLoops(world);
+            UpdateBugs(world, pool);
+
+            // Input moves the player loop for the next tick
+            r32 camSpeed = 2;
+            r32 zoomSpeed = 0.98;
+            if(state==STATE_GAME)
+            {
+                if(IsKeyActionDown(appState, ACTION_Z))
+                {
+                    camera.spherical.z*=zoomSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_X))
+                {
+                    camera.spherical.z/=zoomSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_UP))
+                {
+                    playerLoop->pos.y+=camSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_DOWN))
+                {
+                    playerLoop->pos.y-=camSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_LEFT))
+                {
+                    playerLoop->pos.x-=camSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_RIGHT))
+                {
+                    playerLoop->pos.x+=camSpeed;
+                }
+                if(IsKeyActionDown(appState, ACTION_Q))
+                {
+                    camera.spherical.y-=0.1;
+                    if(camera.spherical.y < 0.1) camera.spherical.y = 0.1;
+                }
+                if(IsKeyActionDown(appState, ACTION_E))
+                {
+                    camera.spherical.y+=0.1;
+                    if(camera.spherical.y > M_PI/2-0.1) camera.spherical.y = M_PI/2-0.1;
+                }
+                if(IsKeyActionDown(appState, ACTION_R))
+                {
+                }
+            }
+            else
+            {
+                r32 worldTime = world->time;
+                playerLoop->pos.x+=cosf(worldTime)*(1.2+sinf(2*worldTime));
+                playerLoop->pos.y+=sinf(worldTime)*(1.2+cosf(worldTime));
+            }
+            tickAccumulator-=SIM_TICK_SECONDS;
+            nTicks++;
+        }
+        if(tickAccumulator >= SIM_TICK_SECONDS)
+        {
+            // Too far behind, drop the backlog instead of spiralling
+            tickAccumulator = 0;
+        }
+        r32 alpha = tickAccumulator/SIM_TICK_SECONDS;
+
         // Clear screen
         Vec3 clearColor = ARGBToVec3(0xffe0fffe);
         glClearColor(clearColor.x, clearColor.y, clearColor.z, 1);
@@ -407,56 +983,12 @@ main(int argc, char**argv)
         
         // Update Camera
         glUseProgram(simpleShader);
-        r32 camSpeed = 2;
-        r32 zoomSpeed = 0.98;
-        if(state==STATE_GAME)
+        if(state!=STATE_GAME)
         {
-            if(IsKeyActionDown(appState, ACTION_Z))
-            {
-                camera.spherical.z*=zoomSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_X))
-            {
-                camera.spherical.z/=zoomSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_UP))
-            {
-                playerLoop->pos.y+=camSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_DOWN))
-            {
-                playerLoop->pos.y-=camSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_LEFT))
-            {
-                playerLoop->pos.x-=camSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_RIGHT))
-            {
-                playerLoop->pos.x+=camSpeed;
-            }
-            if(IsKeyActionDown(appState, ACTION_Q))
-            {
-                camera.spherical.y-=0.1;
-                if(camera.spherical.y < 0.1) camera.spherical.y = 0.1;
-            }
-            if(IsKeyActionDown(appState, ACTION_E))
-            {
-                camera.spherical.y+=0.1;
-                if(camera.spherical.y > M_PI/2-0.1) camera.spherical.y = M_PI/2-0.1;
-            }
-            if(IsKeyActionDown(appState, ACTION_R))
-            {
-            }
-        }
-        else
-        {
-            playerLoop->pos.x+=cosf(time)*(1.2+sinf(2*time));
-            playerLoop->pos.y+=sinf(time)*(1.2+cosf(time));
             camera.spherical.z = 80+sinf(time)*20;
         }
         // Update loop pos
-        camera.lookAt = playerLoop->pos;
+        camera.lookAt = lerp(playerLoop->prevPos, playerLoop->pos, alpha);
         UpdateCamera(&camera, appState->screenWidth, appState->screenHeight);
 
         glEnable(GL_DEPTH_TEST);
@@ -468,16 +1000,51 @@ main(int argc, char**argv)
 
         glEnable(GL_CULL_FACE);
         glCullFace(GL_BACK);
+        Frustum frustum = ExtractFrustum(&camera.transform);
         RenderModel(groundModel);
-
-        UpdateAndRenderLoops(world, dynamicMesh);
-        UpdateAndRenderBugs(world, dynamicMesh);
+        UpdateTerrain(terrain, camera.lookAt);
+        RenderTerrain(terrain, &frustum, camera.pos);
+
+        CullStats cullStats = {};
+        // Upload time is the map and unmap of the dynamic buffer, including
+        // any wait for the gpu to release it
+        ui64 uploadStart = SDL_GetPerformanceCounter();
+        BeginStreamingMesh(dynamicModel, dynamicMesh);
+        uploadTime = GetSecondsElapsed(uploadStart, SDL_GetPerformanceCounter());
+        EmitLoopGeometry(world, dynamicMesh, &frustum, alpha, &cullStats);
+        if(options.cpuBugs)
+        {
+            EmitBugGeometry(world, dynamicMesh, &frustum, alpha, &cullStats);
+        }
+        else
+        {
+            EmitBugInstances(world, &frustum, alpha, bugInstances, &cullStats);
+        }
+        uploadStart = SDL_GetPerformanceCounter();
+        EndStreamingMesh(dynamicModel, dynamicMesh);
+        uploadTime+=GetSecondsElapsed(uploadStart, SDL_GetPerformanceCounter());
 
         // Render dynamic model
-        SetModelFromMesh(dynamicModel, dynamicMesh, GL_DYNAMIC_DRAW);
         glDisable(GL_CULL_FACE);
         RenderModel(dynamicModel);
-        ClearMesh(dynamicMesh);
+
+        if(!options.cpuBugs)
+        {
+            // Bug parts are 6 vertices each: body, 2 antennae, 6 legs
+            glUseProgram(bugShader);
+            glUniformMatrix4fv(bugTransformLocation, 1, GL_FALSE, (GLfloat*)&camera.transform);
+            glUniform3fv(bugLoopColorsLocation, 8, (GLfloat*)world->loopColors);
+            glUniform1f(bugTimeLocation, world->time - (1-alpha)*SIM_TICK_SECONDS);
+            BeginBugInstances(bugInstanceModel);
+            glUniform1i(bugPointModeLocation, 0);
+            DrawBugInstances(bugInstanceModel, bugInstances->instances[BUG_LOD_FULL],
+                    bugInstances->nInstances[BUG_LOD_FULL], 9*6);
+            DrawBugInstances(bugInstanceModel, bugInstances->instances[BUG_LOD_BODY],
+                    bugInstances->nInstances[BUG_LOD_BODY], 6);
+            glUniform1i(bugPointModeLocation, 1);
+            DrawBugInstances(bugInstanceModel, bugInstances->instances[BUG_LOD_POINT],
+                    bugInstances->nInstances[BUG_LOD_POINT], 6);
+        }
 
         // Menu
         r32 menuWidth = 330;
@@ -492,7 +1059,7 @@ main(int argc, char**argv)
             if(nk_button_label(ctx, "begni bgame"))
             {
                 state=STATE_GAME;;
-                ResetWorld(gameArena, &world, groundMesh, groundModel, aiSpeed);
+                ResetWorld(gameArena, &world, groundMesh, groundModel, terrain, aiSpeed, ++seed);
             }
             nk_label_wrap(ctx, "Insrtuctions: Cllect al bugs in u loop");
             nk_label_wrap(ctx, "MOve: WASD/arrows, zoom: Z, X, Tilst camera: Q, E");
@@ -503,9 +1070,14 @@ main(int argc, char**argv)
         }
         else
         {
-            nk_begin(ctx, "game", nk_rect(0,0,400,40), 0);
+            nk_begin(ctx, "game", nk_rect(0,0,400,130), 0);
             nk_layout_row_static(ctx, 30, 250, 1);
             nk_labelf_wrap(ctx, "numnbr of bfugs %d", playerLoop->nBugs);
+            nk_labelf_wrap(ctx, "bugs drawn %d, culled %d", 
+                    cullStats.bugsDrawn, cullStats.bugsCulled);
+            nk_labelf_wrap(ctx, "upload %.3f ms", 1000.0*uploadTime);
+            nk_labelf_wrap(ctx, "ground chunks drawn %d, culled %d", 
+                    terrain->chunksDrawn, terrain->chunksCulled);
             nk_end(ctx);
             // If won
             if(playerLoop->nBugs <= 0 || playerLoop->nBugs >= world->nBugs*0.8)
@@ -525,7 +1097,6 @@ main(int argc, char**argv)
         nk_sdl_render(NK_ANTI_ALIASING_ON, MAX_VERTEX_MEMORY, MAX_ELEMENT_MEMORY);
 
         // frame timing
-        ui32 frameEnd = SDL_GetTicks();
 #if 0
         if(frameEnd > (lastSecond+1)*1000)
         {
@@ -535,32 +1106,11 @@ main(int argc, char**argv)
             frameCounter = 0;
         }
 #endif
-        ui32 frameTicks = frameEnd-frameStart;
-        frameStart=frameEnd;
-        deltaTime=((r32)frameTicks)/1000.0;
-        time+=deltaTime;
-        timeSinceLastFrame+=deltaTime;
-        if(timeSinceLastFrame < updateTime)
-        {
-            i32 waitForTicks = (i32)((updateTime-timeSinceLastFrame)*1000);
-            if(waitForTicks > 0)
-            {
-                //DebugOut("this happened, waitForTicks = %d\n", waitForTicks);
-                if(waitForTicks < 2*updateTime*1000)
-                {
-                    SDL_Delay(waitForTicks);
-                    timeSinceLastFrame-=waitForTicks/1000.0;
-                }
-                else
-                {
-                    timeSinceLastFrame = 0;
-                }
-            }
-        }
-        //DebugOut("time = %f, deltaTime = %f, ticks = %d\n", time, deltaTime, frameTicks);
         SDL_GL_SwapWindow(window);
         frameCounter++;
     }
+    DestroyTerrain(terrain);
+    DestroyWorkerPool(pool);
     SDL_GL_DeleteContext(gl_context);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -0,0 +1,155 @@
+// Every thread draws from its own series so there is no shared state. Seeded
+// from the world seed by SeedThreadRandom.
+global_variable __thread RandomSeries threadRandomSeries = {{0x9e3779b9, 0x243f6a88, 0xb7e15162, 0x6a09e667}};
+
+internal inline ui32
+RotateLeft(ui32 value, int shift)
+{
+    return (value << shift) | (value >> (32-shift));
+}
+
+internal inline ui64
+SplitMix64(ui64 *state)
+{
+    ui64 z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Stateless roll in [0, 1) for work that runs on any thread in any order.
+// The same key always gives the same number.
+internal r32
+RandomHashUnilateral(ui64 seed, ui32 a, ui32 b, ui32 c)
+{
+    ui64 state = seed ^ (((ui64)a << 32) | b) ^ ((ui64)c*0xd1b54a32d192ed03ull);
+    return (r32)(SplitMix64(&state) >> 40)*(1.0f/16777216.0f);
+}
+
+internal RandomSeries
+SeedRandomSeries(ui64 seed)
+{
+    RandomSeries series;
+    ui64 a = SplitMix64(&seed);
+    ui64 b = SplitMix64(&seed);
+    series.s[0] = (ui32)a;
+    series.s[1] = (ui32)(a >> 32);
+    series.s[2] = (ui32)b;
+    series.s[3] = (ui32)(b >> 32);
+    if(!(series.s[0] | series.s[1] | series.s[2] | series.s[3]))
+    {
+        series.s[0] = 1;
+    }
+    return series;
+}
+
+internal inline ui32
+RandomNextUI32(RandomSeries *series)
+{
+    ui32 *s = series->s;
+    ui32 result = RotateLeft(s[1]*5, 7)*9;
+    ui32 t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RotateLeft(s[3], 11);
+    return result;
+}
+
+// Top 24 bits, so every value is exactly representable. Range [0, 1).
+internal inline r32
+RandomUnilateral(RandomSeries *series)
+{
+    return (r32)(RandomNextUI32(series) >> 8)*(1.0f/16777216.0f);
+}
+
+internal inline r32
+RandomBetween(RandomSeries *series, r32 min, r32 max)
+{
+    return min + (max-min)*RandomUnilateral(series);
+}
+
+internal void
+SeedThreadRandom(ui64 seed)
+{
+    threadRandomSeries = SeedRandomSeries(seed);
+}
+
+internal r32
+RandomFloat(r32 min, r32 max)
+{
+    return RandomBetween(&threadRandomSeries, min, max);
+}
+
+internal inline RandomSeries
+LoadRandomStream(RandomStreams *streams, int idx)
+{
+    RandomSeries series = {{streams->s[0][idx], streams->s[1][idx], 
+        streams->s[2][idx], streams->s[3][idx]}};
+    return series;
+}
+
+internal inline void
+StoreRandomStream(RandomStreams *streams, int idx, RandomSeries *series)
+{
+    streams->s[0][idx] = series->s[0];
+    streams->s[1][idx] = series->s[1];
+    streams->s[2][idx] = series->s[2];
+    streams->s[3][idx] = series->s[3];
+}
+
+// Every stream gets its own seed so the element index alone decides its numbers.
+internal void
+SeedRandomStream(RandomStreams *streams, int idx, ui64 seed)
+{
+    RandomSeries series = SeedRandomSeries(seed + idx*0x632be59bd9b4e019ull);
+    StoreRandomStream(streams, idx, &series);
+}
+
+// Advances streams [begin, end) once and writes a number in [0, 1) for each to
+// dest[begin, end). The state arrays have to be 16 byte aligned and begin a
+// multiple of 4 for the simd path.
+internal void
+RandomFillUnilateral(RandomStreams *streams, int begin, int end, r32 *dest)
+{
+    int idx = begin;
+#if defined(__SSE2__)
+    __m128 toUnilateral = _mm_set1_ps(1.0f/16777216.0f);
+    for(;
+            idx+4 <= end;
+            idx+=4)
+    {
+        __m128i s0 = _mm_load_si128((__m128i *)(streams->s[0]+idx));
+        __m128i s1 = _mm_load_si128((__m128i *)(streams->s[1]+idx));
+        __m128i s2 = _mm_load_si128((__m128i *)(streams->s[2]+idx));
+        __m128i s3 = _mm_load_si128((__m128i *)(streams->s[3]+idx));
+        // rotl(s1*5, 7)*9 with shifts and adds, SSE2 has no 32 bit mullo
+        __m128i x = _mm_add_epi32(_mm_slli_epi32(s1, 2), s1);
+        x = _mm_or_si128(_mm_slli_epi32(x, 7), _mm_srli_epi32(x, 25));
+        x = _mm_add_epi32(_mm_slli_epi32(x, 3), x);
+        __m128i t = _mm_slli_epi32(s1, 9);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+        _mm_store_si128((__m128i *)(streams->s[0]+idx), s0);
+        _mm_store_si128((__m128i *)(streams->s[1]+idx), s1);
+        _mm_store_si128((__m128i *)(streams->s[2]+idx), s2);
+        _mm_store_si128((__m128i *)(streams->s[3]+idx), s3);
+        __m128 result = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), toUnilateral);
+        _mm_storeu_ps(dest+idx, result);
+    }
+#endif
+    for(;
+            idx < end;
+            idx++)
+    {
+        RandomSeries series = LoadRandomStream(streams, idx);
+        dest[idx] = RandomUnilateral(&series);
+        StoreRandomStream(streams, idx, &series);
+    }
+}
@@ -0,0 +1,13 @@
+// xoshiro128** generators. RandomSeries is a single stream. RandomStreams
+// holds one stream per element with every state word in its own array, so
+// four neighbouring streams map onto one SSE register. The scalar and simd
+// paths produce the same numbers.
+typedef struct
+{
+    ui32 s[4];
+} RandomSeries;
+
+typedef struct
+{
+    ui32 *s[4];         // s[stateWord][element]
+} RandomStreams;
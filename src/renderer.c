@@ -55,6 +55,83 @@ float perlin2d(float x, float y, float freq, int depth)
     return fin/div;
 }
 
+#if defined(__SSE2__)
+internal inline __m128
+smooth_inter4(__m128 x, __m128 y, __m128 s)
+{
+    __m128 w = _mm_mul_ps(_mm_mul_ps(s, s), _mm_sub_ps(_mm_set1_ps(3), _mm_mul_ps(_mm_set1_ps(2), s)));
+    return _mm_add_ps(x, _mm_mul_ps(w, _mm_sub_ps(y, x)));
+}
+#endif
+
+// perlin2d(x+i, y, freq, depth) for i in 0..n-1, 4 samples at a time with the
+// same float operations in the same order, so the results are bit identical.
+// The row shares y, so the y half of the lattice hash is done once per
+// octave. SSE2 has no gather, the x half is 4 scalar lookups per corner.
+// Coordinates must not be negative, as for perlin2d.
+void perlin2d_row(float *result, int n, float x, float y, float freq, int depth)
+{
+    float div = 0.0;
+    float amp = 1.0;
+    int i;
+    for(i=0; i<depth; i++)
+    {
+        div += 256 * amp;
+        amp /= 2;
+    }
+
+    int sample = 0;
+#if defined(__SSE2__)
+    for(; sample+4 <= n; sample+=4)
+    {
+        __m128 xa = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(x), 
+                    _mm_set_ps(sample+3, sample+2, sample+1, sample)), _mm_set1_ps(freq));
+        float ya = y*freq;
+        __m128 amp4 = _mm_set1_ps(1.0);
+        __m128 fin = _mm_setzero_ps();
+        for(i=0; i<depth; i++)
+        {
+            __m128i x_int = _mm_cvttps_epi32(xa);
+            __m128 x_frac = _mm_sub_ps(xa, _mm_cvtepi32_ps(x_int));
+            int y_int = ya;
+            float y_frac = ya - y_int;
+            int low_row = hash[(y_int + SEED) & 255];
+            int high_row = hash[(y_int + 1 + SEED) & 255];
+            int xs[4];
+            _mm_storeu_si128((__m128i *)xs, x_int);
+            __m128 s = _mm_cvtepi32_ps(_mm_set_epi32(hash[(low_row + xs[3]) & 255], 
+                        hash[(low_row + xs[2]) & 255], 
+                        hash[(low_row + xs[1]) & 255], 
+                        hash[(low_row + xs[0]) & 255]));
+            __m128 t = _mm_cvtepi32_ps(_mm_set_epi32(hash[(low_row + xs[3] + 1) & 255], 
+                        hash[(low_row + xs[2] + 1) & 255], 
+                        hash[(low_row + xs[1] + 1) & 255], 
+                        hash[(low_row + xs[0] + 1) & 255]));
+            __m128 u = _mm_cvtepi32_ps(_mm_set_epi32(hash[(high_row + xs[3]) & 255], 
+                        hash[(high_row + xs[2]) & 255], 
+                        hash[(high_row + xs[1]) & 255], 
+                        hash[(high_row + xs[0]) & 255]));
+            __m128 v = _mm_cvtepi32_ps(_mm_set_epi32(hash[(high_row + xs[3] + 1) & 255], 
+                        hash[(high_row + xs[2] + 1) & 255], 
+                        hash[(high_row + xs[1] + 1) & 255], 
+                        hash[(high_row + xs[0] + 1) & 255]));
+            __m128 low = smooth_inter4(s, t, x_frac);
+            __m128 high = smooth_inter4(u, v, x_frac);
+            __m128 noise = smooth_inter4(low, high, _mm_set1_ps(y_frac));
+            fin = _mm_add_ps(fin, _mm_mul_ps(noise, amp4));
+            amp4 = _mm_div_ps(amp4, _mm_set1_ps(2));
+            xa = _mm_mul_ps(xa, _mm_set1_ps(2));
+            ya *= 2;
+        }
+        _mm_storeu_ps(result+sample, _mm_div_ps(fin, _mm_set1_ps(div)));
+    }
+#endif
+    for(; sample < n; sample++)
+    {
+        result[sample] = perlin2d(x+sample, y, freq, depth);
+    }
+}
+
 internal inline Vec3
 ARGBToVec3(ui32 hex)
 {
@@ -87,6 +164,100 @@ UpdateCamera(Camera *camera, r32 width, r32 height)
             );
 }
 
+// Gribb-Hartmann, every plane is the sum or difference of the last row of
+// the view projection matrix with one of the others.
+internal Frustum
+ExtractFrustum(Mat4 *m)
+{
+    Frustum frustum;
+    for(int planeIdx = 0;
+            planeIdx < 6;
+            planeIdx++)
+    {
+        int row = planeIdx/2;
+        r32 sign = (planeIdx&1) ? -1 : 1;
+        Vec4 plane = vec4(m->m[0][3] + sign*m->m[0][row],
+                m->m[1][3] + sign*m->m[1][row],
+                m->m[2][3] + sign*m->m[2][row],
+                m->m[3][3] + sign*m->m[3][row]);
+        r32 invLength = 1.0f/sqrtf(plane.x*plane.x + plane.y*plane.y + plane.z*plane.z);
+        frustum.planes[planeIdx] = vec4(plane.x*invLength, plane.y*invLength, 
+                plane.z*invLength, plane.w*invLength);
+    }
+    return frustum;
+}
+
+internal inline b32
+IsSphereInFrustum(Frustum *frustum, Vec3 center, r32 radius)
+{
+    for(int planeIdx = 0;
+            planeIdx < 6;
+            planeIdx++)
+    {
+        Vec4 plane = frustum->planes[planeIdx];
+        if(plane.x*center.x + plane.y*center.y + plane.z*center.z + plane.w < -radius)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+internal int
+GetVertexSize(VertexFormat format)
+{
+    return format==VERTEX_FORMAT_PACKED ? sizeof(PackedVertex) : MESH_STRIDE*sizeof(r32);
+}
+
+internal inline ui32
+PackUnorm8(r32 value)
+{
+    value = value < 0 ? 0 : (value > 1 ? 1 : value);
+    return (ui32)(value*255.0f + 0.5f);
+}
+
+internal inline ui32
+PackColor(Vec3 color)
+{
+    return PackUnorm8(color.x) | (PackUnorm8(color.y) << 8) | 
+        (PackUnorm8(color.z) << 16) | (255u << 24);
+}
+
+internal inline ui32
+PackSnorm10(r32 value)
+{
+    value = value < -1 ? -1 : (value > 1 ? 1 : value);
+    i32 result = (i32)(value*511.0f + (value < 0 ? -0.5f : 0.5f));
+    return (ui32)result & 0x3ff;
+}
+
+// Signed 10 bits per component, x in the lowest bits
+internal inline ui32
+PackNormal(Vec3 normal)
+{
+    return PackSnorm10(normal.x) | (PackSnorm10(normal.y) << 10) | (PackSnorm10(normal.z) << 20);
+}
+
+// Tests the corner of the box furthest along each plane normal
+internal b32
+IsBoxInFrustum(Frustum *frustum, Vec3 boxMin, Vec3 boxMax)
+{
+    for(int planeIdx = 0;
+            planeIdx < 6;
+            planeIdx++)
+    {
+        Vec4 plane = frustum->planes[planeIdx];
+        r32 x = plane.x > 0 ? boxMax.x : boxMin.x;
+        r32 y = plane.y > 0 ? boxMax.y : boxMin.y;
+        r32 z = plane.z > 0 ? boxMax.z : boxMin.z;
+        if(plane.x*x + plane.y*y + plane.z*z + plane.w < 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 internal void
 InitMesh(MemoryArena *arena, Mesh *mesh, int maxVertices)
 {
@@ -96,11 +267,49 @@ InitMesh(MemoryArena *arena, Mesh *mesh, int maxVertices)
     mesh->vertices = PushArray(arena, Vec3, maxVertices);
     mesh->colors = PushArray(arena, Vec3, maxVertices);
     mesh->normals = PushArray(arena, Vec3, maxVertices);
+    mesh->format = VERTEX_FORMAT_FLOAT;
+    mesh->interleaved = NULL;
+    mesh->nIndices = 0;
+    mesh->maxIndices = maxVertices;
+    mesh->indices = PushArray(arena, ui32, maxVertices);
+}
+
+// The Push functions write vertices in the layout of the Model, so
+// SetModelFromMesh can upload them without repacking.
+internal void
+InitInterleavedMesh(MemoryArena *arena, Mesh *mesh, int maxVertices, VertexFormat format)
+{
+    mesh->colorState = vec3(1,1,1);
+    mesh->nVertices = 0;
+    mesh->maxVertices = maxVertices;
+    mesh->vertices = NULL;
+    mesh->colors = NULL;
+    mesh->normals = NULL;
+    mesh->format = format;
+    mesh->interleaved = PushArray(arena, ui8, (size_t)maxVertices*GetVertexSize(format));
     mesh->nIndices = 0;
     mesh->maxIndices = maxVertices;
     mesh->indices = PushArray(arena, ui32, maxVertices);
 }
 
+// The arrays of a streaming mesh are the mapped buffers of its Model, it can
+// only be pushed to between BeginStreamingMesh and EndStreamingMesh.
+internal void
+InitStreamingMesh(Mesh *mesh)
+{
+    mesh->colorState = vec3(1,1,1);
+    mesh->nVertices = 0;
+    mesh->maxVertices = 0;
+    mesh->vertices = NULL;
+    mesh->colors = NULL;
+    mesh->normals = NULL;
+    mesh->format = VERTEX_FORMAT_FLOAT;
+    mesh->interleaved = NULL;
+    mesh->nIndices = 0;
+    mesh->maxIndices = 0;
+    mesh->indices = NULL;
+}
+
 internal Mesh *
 CreateMesh(MemoryArena *arena, int maxVertices)
 {
@@ -109,6 +318,14 @@ CreateMesh(MemoryArena *arena, int maxVertices)
     return mesh;
 }
 
+internal Mesh *
+CreateInterleavedMesh(MemoryArena *arena, int maxVertices, VertexFormat format)
+{
+    Mesh *mesh = PushStruct(arena, Mesh);
+    InitInterleavedMesh(arena, mesh, maxVertices, format);
+    return mesh;
+}
+
 internal void
 ClearMesh(Mesh *mesh)
 {
@@ -116,77 +333,351 @@ ClearMesh(Mesh *mesh)
     mesh->nIndices = 0;
 }
 
+// Attribute layout of the format, for the bound vao and array buffer
 internal void
-InitModel(MemoryArena *arena, Model *model, int maxVertices)
+SetModelVertexAttributes(Model *model)
+{
+    glEnableVertexAttribArray(0);       // Positions
+    glEnableVertexAttribArray(1);       // Colors
+    glEnableVertexAttribArray(2);       // Normals
+    if(model->format==VERTEX_FORMAT_PACKED)
+    {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 
+                model->stride, (void *)offsetof(PackedVertex, x));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 
+                model->stride, (void *)offsetof(PackedVertex, color));
+        glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 
+                model->stride, (void *)offsetof(PackedVertex, normal));
+    }
+    else
+    {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 
+                model->stride, (void *)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 
+                model->stride, (void *)(3*sizeof(r32)));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 
+                model->stride, (void *)(6*sizeof(r32)));
+    }
+}
+
+// Model without cpu side buffers, only filled with SetModelFromData
+internal void
+InitDataModel(Model *model, int maxVertices, VertexFormat format)
 {
     glGenVertexArrays(1, &model->vao);
     glGenBuffers(1, &model->vbo);
     glGenBuffers(1, &model->ebo);
-    model->stride = 9;
+    model->format = format;
+    model->stride = GetVertexSize(format);
     model->vertexBufferSize = 0;
     model->maxVertexBufferSize = maxVertices*model->stride;
     model->maxIndexBufferSize = maxVertices;
     model->indexBufferSize = 0;
-
-    model->vertexBuffer = PushArray(arena, r32, maxVertices*model->stride);
-    model->indexBuffer = PushArray(arena, ui32, maxVertices);
+    model->vertexBuffer = NULL;
+    model->indexBuffer = NULL;
+    model->indexType = GL_UNSIGNED_INT;
+    model->isStreaming = 0;
 
     glBindVertexArray(model->vao);
     glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
-    glEnableVertexAttribArray(0);       // Positions
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 
-            model->stride*sizeof(r32), (void *)0);
-    glEnableVertexAttribArray(1);       // Colors
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 
-            model->stride*sizeof(r32), (void *)(3*sizeof(r32)));
-    glEnableVertexAttribArray(2);       // Normals
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 
-            model->stride*sizeof(r32), (void *)(6*sizeof(r32)));
+    SetModelVertexAttributes(model);
 }
 
 internal void
-SetModelFromMesh(Model *model, Mesh *mesh, GLenum drawMode)
+InitModel(MemoryArena *arena, Model *model, int maxVertices, VertexFormat format)
+{
+    InitDataModel(model, maxVertices, format);
+    model->vertexBuffer = PushArray(arena, ui8, maxVertices*model->stride);
+    model->indexBuffer = PushArray(arena, ui32, maxVertices);
+}
+
+// Triple buffered model for geometry that changes every frame. The mesh is
+// written straight into mapped buffer memory, unsynchronized, and fences keep
+// the cpu off the segments the gpu may still read.
+internal void
+InitStreamingModel(Model *model, int maxVertices, VertexFormat format)
 {
+    glGenVertexArrays(1, &model->vao);
+    glGenBuffers(1, &model->vbo);
+    glGenBuffers(1, &model->ebo);
+    model->format = format;
+    model->stride = GetVertexSize(format);
     model->vertexBufferSize = 0;
+    model->maxVertexBufferSize = maxVertices*model->stride;
+    model->maxIndexBufferSize = maxVertices;
     model->indexBufferSize = 0;
+    model->vertexBuffer = NULL;
+    model->indexBuffer = NULL;
+    model->indexType = GL_UNSIGNED_INT;
+    model->isStreaming = 1;
+    model->streamSegment = 0;
+    for(int segment = 0;
+            segment < STREAM_SEGMENTS;
+            segment++)
+    {
+        model->streamFences[segment] = 0;
+    }
+
+    glBindVertexArray(model->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    glBufferData(GL_ARRAY_BUFFER, STREAM_SEGMENTS*model->maxVertexBufferSize, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, STREAM_SEGMENTS*model->maxIndexBufferSize*sizeof(ui32), 
+            NULL, GL_STREAM_DRAW);
+    SetModelVertexAttributes(model);
+}
+
+internal void
+SetBugInstanceAttributes(size_t offset)
+{
+    GLsizei stride = sizeof(BugInstance);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride, 
+            (void *)(offset+offsetof(BugInstance, x)));
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, stride, 
+            (void *)(offset+offsetof(BugInstance, scale)));
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, stride, 
+            (void *)(offset+offsetof(BugInstance, colorIndex)));
+    glVertexAttribPointer(3, 1, GL_UNSIGNED_SHORT, GL_TRUE, stride, 
+            (void *)(offset+offsetof(BugInstance, legPhase)));
+}
+
+// Instanced bugs have no vertex buffer, the shader builds every vertex from
+// gl_VertexID and the instance.
+internal void
+InitBugInstanceModel(BugInstanceModel *model, int maxInstances)
+{
+    glGenVertexArrays(1, &model->vao);
+    glGenBuffers(1, &model->vbo);
+    model->maxInstances = maxInstances;
+    model->nUploaded = 0;
+
+    glBindVertexArray(model->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    glBufferData(GL_ARRAY_BUFFER, maxInstances*sizeof(BugInstance), NULL, GL_STREAM_DRAW);
+    for(int attribute = 0;
+            attribute < 4;
+            attribute++)
+    {
+        glEnableVertexAttribArray(attribute);
+        glVertexAttribDivisor(attribute, 1);
+    }
+    SetBugInstanceAttributes(0);
+}
+
+// Orphans the instance buffer so this frame does not wait for the last one.
+// Call once per frame before DrawBugInstances.
+internal void
+BeginBugInstances(BugInstanceModel *model)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    glBufferData(GL_ARRAY_BUFFER, model->maxInstances*sizeof(BugInstance), NULL, GL_STREAM_DRAW);
+    model->nUploaded = 0;
+}
+
+// Appends the instances to the buffer and draws the first nVertices vertices
+// of the bug for each of them.
+internal void
+DrawBugInstances(BugInstanceModel *model, BugInstance *instances, int nInstances, int nVertices)
+{
+    if(nInstances==0)
+    {
+        return;
+    }
+    Assert(model->nUploaded+nInstances <= model->maxInstances);
+    size_t offset = model->nUploaded*sizeof(BugInstance);
+    glBindVertexArray(model->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, nInstances*sizeof(BugInstance), instances);
+    SetBugInstanceAttributes(offset);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, nVertices, nInstances);
+    model->nUploaded+=nInstances;
+}
+
+// Repacks the separate arrays of the mesh into a Model layout, returns the
+// number of bytes written.
+internal int
+PackMeshVertices(ui8 *dest, Mesh *mesh, VertexFormat format)
+{
+    if(format==VERTEX_FORMAT_PACKED)
+    {
+        PackedVertex *packed = (PackedVertex *)dest;
+        for(int vertexIdx = 0;
+                vertexIdx < mesh->nVertices;
+                vertexIdx++)
+        {
+            Vec3 vert = mesh->vertices[vertexIdx];
+            packed[vertexIdx].x = vert.x;
+            packed[vertexIdx].y = vert.y;
+            packed[vertexIdx].z = vert.z;
+            packed[vertexIdx].color = PackColor(mesh->colors[vertexIdx]);
+            packed[vertexIdx].normal = PackNormal(mesh->normals[vertexIdx]);
+        }
+        return mesh->nVertices*sizeof(PackedVertex);
+    }
+    r32 *floats = (r32 *)dest;
+    int size = 0;
     for(int vertexIdx = 0;
-            vertexIdx < mesh->nIndices;
+            vertexIdx < mesh->nVertices;
             vertexIdx++)
     {
         Vec3 vert = mesh->vertices[vertexIdx];
         Vec3 col = mesh->colors[vertexIdx];
         Vec3 norm = mesh->normals[vertexIdx];
-        model->vertexBuffer[model->vertexBufferSize++] = vert.x;
-        model->vertexBuffer[model->vertexBufferSize++] = vert.y;
-        model->vertexBuffer[model->vertexBufferSize++] = vert.z;
-        model->vertexBuffer[model->vertexBufferSize++] = col.x;
-        model->vertexBuffer[model->vertexBufferSize++] = col.y;
-        model->vertexBuffer[model->vertexBufferSize++] = col.z;
-        model->vertexBuffer[model->vertexBufferSize++] = norm.x;
-        model->vertexBuffer[model->vertexBufferSize++] = norm.y;
-        model->vertexBuffer[model->vertexBufferSize++] = norm.z;
-        Assert(model->vertexBufferSize < model->maxVertexBufferSize);
+        floats[size++] = vert.x;
+        floats[size++] = vert.y;
+        floats[size++] = vert.z;
+        floats[size++] = col.x;
+        floats[size++] = col.y;
+        floats[size++] = col.z;
+        floats[size++] = norm.x;
+        floats[size++] = norm.y;
+        floats[size++] = norm.z;
     }
-    Assert(model->maxIndexBufferSize > mesh->nIndices);
-    memcpy(model->indexBuffer, mesh->indices, mesh->nIndices*sizeof(ui32));
+    return size*sizeof(r32);
+}
+
+// Uploads vertices that are already in the layout of the model, and 16 or 32
+// bit indices, straight from where they are, like a mapped file.
+internal void
+SetModelFromData(Model *model, void *vertexData, int nVertices, 
+        void *indexData, int nIndices, GLenum indexType, GLenum drawMode)
+{
+    Assert(!model->isStreaming);
+    Assert(nVertices*model->stride < model->maxVertexBufferSize);
+    Assert(model->maxIndexBufferSize > nIndices);
+    model->vertexBufferSize = nVertices*model->stride;
+    model->indexBufferSize = nIndices;
+    model->indexType = indexType;
+    size_t indexSize = indexType==GL_UNSIGNED_SHORT ? sizeof(ui16) : sizeof(ui32);
     glBindVertexArray(model->vao);
-    model->indexBufferSize = mesh->nIndices;
 
     glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
-    glBufferData(GL_ARRAY_BUFFER, model->vertexBufferSize*sizeof(r32), 
-            model->vertexBuffer, drawMode);
+    glBufferData(GL_ARRAY_BUFFER, model->vertexBufferSize, 
+            vertexData, drawMode);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->indexBufferSize*sizeof(ui32), 
-            model->indexBuffer, drawMode);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->indexBufferSize*indexSize, 
+            indexData, drawMode);
+}
+
+internal void
+SetModelFromMesh(Model *model, Mesh *mesh, GLenum drawMode)
+{
+    Assert(model->indexBuffer);
+    Assert(mesh->nVertices*model->stride < model->maxVertexBufferSize);
+    Assert(model->maxIndexBufferSize > mesh->nIndices);
+    void *vertexData = mesh->interleaved;
+    void *indexData = mesh->indices;
+    if(vertexData)
+    {
+        Assert(mesh->format==model->format);
+    }
+    else
+    {
+        PackMeshVertices(model->vertexBuffer, mesh, model->format);
+        vertexData = model->vertexBuffer;
+    }
+    GLenum indexType = GL_UNSIGNED_INT;
+    if(mesh->nVertices <= 0x10000)
+    {
+        // Small enough for 16 bit indices, halves the index buffer
+        ui16 *shortIndices = (ui16 *)model->indexBuffer;
+        for(int indexIdx = 0;
+                indexIdx < mesh->nIndices;
+                indexIdx++)
+        {
+            shortIndices[indexIdx] = (ui16)mesh->indices[indexIdx];
+        }
+        indexData = shortIndices;
+        indexType = GL_UNSIGNED_SHORT;
+    }
+    else if(!mesh->interleaved)
+    {
+        memcpy(model->indexBuffer, mesh->indices, mesh->nIndices*sizeof(ui32));
+        indexData = model->indexBuffer;
+    }
+    SetModelFromData(model, vertexData, mesh->nVertices, indexData, mesh->nIndices, indexType, drawMode);
+}
+
+// Maps the next segment of a streaming model for the mesh to push into.
+// Waits only if the gpu is still drawing from that segment, which is
+// STREAM_SEGMENTS-1 frames old.
+internal void
+BeginStreamingMesh(Model *model, Mesh *mesh)
+{
+    Assert(model->isStreaming);
+    model->streamSegment = (model->streamSegment+1)%STREAM_SEGMENTS;
+    int segment = model->streamSegment;
+    GLsync fence = model->streamFences[segment];
+    if(fence)
+    {
+        while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000)==GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        model->streamFences[segment] = 0;
+    }
+
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+    glBindVertexArray(model->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    mesh->interleaved = glMapBufferRange(GL_ARRAY_BUFFER, 
+            (GLintptr)segment*model->maxVertexBufferSize, model->maxVertexBufferSize, access);
+    mesh->indices = (ui32 *)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 
+            (GLintptr)segment*model->maxIndexBufferSize*sizeof(ui32), 
+            model->maxIndexBufferSize*sizeof(ui32), access);
+    Assert(mesh->interleaved && mesh->indices);
+    mesh->format = model->format;
+    mesh->nVertices = 0;
+    mesh->maxVertices = model->maxIndexBufferSize;
+    mesh->nIndices = 0;
+    mesh->maxIndices = model->maxIndexBufferSize;
+}
+
+internal void
+EndStreamingMesh(Model *model, Mesh *mesh)
+{
+    glBindVertexArray(model->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+    model->vertexBufferSize = mesh->nVertices*model->stride;
+    model->indexBufferSize = mesh->nIndices;
+    mesh->interleaved = NULL;
+    mesh->indices = NULL;
+    mesh->maxVertices = 0;
+    mesh->maxIndices = 0;
 }
 
 internal void
 PushVertex(Mesh *mesh, Vec3 pos, Vec3 normal)
 {
-    mesh->vertices[mesh->nVertices] = pos;
-    mesh->colors[mesh->nVertices] = mesh->colorState;
-    mesh->normals[mesh->nVertices] = normal;
+    if(mesh->interleaved && mesh->format==VERTEX_FORMAT_PACKED)
+    {
+        PackedVertex *dest = (PackedVertex *)mesh->interleaved + mesh->nVertices;
+        dest->x = pos.x;
+        dest->y = pos.y;
+        dest->z = pos.z;
+        dest->color = PackColor(mesh->colorState);
+        dest->normal = PackNormal(normal);
+    }
+    else if(mesh->interleaved)
+    {
+        r32 *dest = (r32 *)mesh->interleaved + mesh->nVertices*MESH_STRIDE;
+        dest[0] = pos.x;
+        dest[1] = pos.y;
+        dest[2] = pos.z;
+        dest[3] = mesh->colorState.x;
+        dest[4] = mesh->colorState.y;
+        dest[5] = mesh->colorState.z;
+        dest[6] = normal.x;
+        dest[7] = normal.y;
+        dest[8] = normal.z;
+    }
+    else
+    {
+        mesh->vertices[mesh->nVertices] = pos;
+        mesh->colors[mesh->nVertices] = mesh->colorState;
+        mesh->normals[mesh->nVertices] = normal;
+    }
     mesh->nVertices++;
     Assert(mesh->nVertices < mesh->maxIndices);
 }
@@ -264,25 +755,17 @@ internal inline void
 PushLineCircle(Mesh *mesh, Vec3 center, r32 radius, int nPoints, r32 lineWidth)
 {
     Vec3 prev = vec3(center.x+radius, center.y, center.z);
+    Vec2 *circle = GetUnitCircle(nPoints);
     for(int point = 0;
             point < nPoints;
             point++)
     {
-        r32 angle = point * (M_PI*2.0 / (nPoints-1));
-        r32 c = cosf(angle);
-        r32 s = sinf(angle);
-        Vec3 p = v3_add(center, vec3(c*radius, s*radius, 0));
+        Vec3 p = v3_add(center, vec3(circle[point].x*radius, circle[point].y*radius, 0));
         PushLine(mesh, prev, p, lineWidth, vec3(0,0,1));
         prev = p;
     }
 }
 
-internal r32
-RandomFloat(r32 min, r32 max)
-{
-    return min + (max-min)*(rand()%10000)/10000.0;
-}
-
 internal inline Vec3
 lerp(Vec3 from, Vec3 to, r32 lambda)
 {
@@ -296,36 +779,6 @@ PushFlatField(Mesh *mesh, r32 width, r32 height)
             vec3(width, height, 0), vec3(0, height, 0));
 }
 
-internal void
-PushHeightField(Mesh *mesh, r32 tileSize, int width, int height)
-{
-    r32 xScale = 1.0;
-    r32 yScale = 1.0;
-    Vec3 positions[(width)*(height)];
-    mesh->colorState = ARGBToVec3(0xfffffb87);
-    r32 depth = 4;
-    for(int y = 0; y < height; y++)
-    for(int x = 0; x < width; x++)
-    {
-        r32 perlin = perlin2d(x*xScale, y*yScale, 1, 7);
-        r32 z = depth*perlin - depth;
-        r32 dev = 0.2;
-        positions[x+y*width] = vec3(tileSize*(x+RandomFloat(-dev, dev)),
-                    tileSize*(y+RandomFloat(-dev, dev)), 
-                    z);
-    }
-    for(int y = 0; y < height-1; y++)
-    for(int x = 0; x < width-1; x++)
-    {
-        Vec3 p0 = positions[x+y*width];
-        Vec3 p1 = positions[x+1+y*width];
-        Vec3 p2 = positions[x+1+(y+1)*width];
-        Vec3 p3 = positions[x+(y+1)*width];
-        PushTriangle(mesh, p0, p1, p2);
-        PushTriangle(mesh, p2, p3, p0);
-    }
-}
-
 internal inline void
 PushCube(Mesh *mesh, Vec3 origin, Vec3 dimensions)
 {
@@ -401,6 +854,22 @@ internal void
 RenderModel(Model *model)
 {
     glBindVertexArray(model->vao);
-    glDrawElements(GL_TRIANGLES, model->indexBufferSize, GL_UNSIGNED_INT, 0);
+    if(model->isStreaming)
+    {
+        // The fence is passed when the gpu is done with this segment
+        int segment = model->streamSegment;
+        glDrawElementsBaseVertex(GL_TRIANGLES, model->indexBufferSize, GL_UNSIGNED_INT, 
+                (void *)((size_t)segment*model->maxIndexBufferSize*sizeof(ui32)), 
+                segment*model->maxIndexBufferSize);
+        if(model->streamFences[segment])
+        {
+            glDeleteSync(model->streamFences[segment]);
+        }
+        model->streamFences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    else
+    {
+        glDrawElements(GL_TRIANGLES, model->indexBufferSize, model->indexType, 0);
+    }
 }
 
@@ -1,3 +1,24 @@
+// Vertex layouts of a Model, both with position, color and normal
+typedef enum
+{
+    VERTEX_FORMAT_FLOAT,        // 9 floats, 36 bytes
+    VERTEX_FORMAT_PACKED,       // PackedVertex, 20 bytes
+} VertexFormat;
+
+// Floats per VERTEX_FORMAT_FLOAT vertex
+#define MESH_STRIDE 9
+
+// Colors are RGBA8 and normals GL_INT_2_10_10_10_REV, the shader sees the
+// same vec3 attributes as with floats.
+typedef struct
+{
+    r32 x;
+    r32 y;
+    r32 z;
+    ui32 color;
+    ui32 normal;
+} PackedVertex;
+
 typedef struct 
 {
     Vec3 colorState;
@@ -6,28 +27,68 @@ typedef struct
     Vec3 *vertices;
     Vec3 *colors;
     Vec3 *normals;
+    VertexFormat format;
+    void *interleaved;  // if set, vertices are written here in the Model layout instead
     int nIndices;
     int maxIndices;
     ui32 *indices;
 } Mesh;
 
+#define STREAM_SEGMENTS 3
+
+typedef enum
+{
+    HEIGHTFIELD_SMOOTH,     // one shared vertex per grid point
+    HEIGHTFIELD_FLAT,       // three vertices per triangle, one normal per face
+} HeightFieldShading;
+
 typedef struct 
 {
     ui32 vao;
     ui32 vbo;
     ui32 ebo;
-    int stride;
+    VertexFormat format;
+    int stride;         // bytes per vertex
 
-    int vertexBufferSize;
+    int vertexBufferSize;       // in bytes
     int maxVertexBufferSize;
-    r32 *vertexBuffer;
+    ui8 *vertexBuffer;
 
     int indexBufferSize;
     int maxIndexBufferSize;
     ui32 *indexBuffer;
+    GLenum indexType;   // GL_UNSIGNED_SHORT when all vertices fit in 16 bits
+
+    // Streaming models have no cpu side buffers. The gpu buffers hold
+    // STREAM_SEGMENTS frames, see BeginStreamingMesh.
+    b32 isStreaming;
+    int streamSegment;
+    GLsync streamFences[STREAM_SEGMENTS];
 } Model;
 
 
+// Per bug data of instanced rendering, 24 bytes. The bug vertex shader
+// builds the whole bug from this.
+typedef struct
+{
+    r32 x;
+    r32 y;
+    r32 z;
+    r32 orientation;
+    r32 scale;
+    ui8 colorIndex;
+    ui8 padding;
+    ui16 legPhase;      // position in the step cycle, 0 to 65535
+} BugInstance;
+
+typedef struct
+{
+    ui32 vao;
+    ui32 vbo;
+    int maxInstances;
+    int nUploaded;      // instances in the buffer this frame
+} BugInstanceModel;
+
 typedef struct
 {
     Vec3 pos;
@@ -36,4 +97,11 @@ typedef struct
     Mat4 transform;
 } Camera;
 
+// Planes of the view volume as ax+by+cz+d >= 0 inside, normalized so the
+// plane value is the signed distance.
+typedef struct
+{
+    Vec4 planes[6];
+} Frustum;
+
 
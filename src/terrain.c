@@ -0,0 +1,773 @@
+// Grid points are jittered by a hash of their coordinates, so any chunk can
+// be built on its own and still meet its neighbours. Points on chunk edges
+// only move along the edge, which keeps the edges straight at every level of
+// detail and leaves the skirts only height gaps to cover.
+internal Vec3
+GetTerrainPoint(TerrainShape *shape, TerrainHeights *heights, int x, int y)
+{
+    r32 z = heights->heights[x-heights->firstX + (y-heights->firstY)*heights->width];
+    r32 dev = 0.2;
+    r32 jitterX = 0;
+    r32 jitterY = 0;
+    if(x % TERRAIN_CHUNK_CELLS)
+    {
+        jitterX = dev*(2*RandomHashUnilateral(shape->seed, x, y, 0)-1);
+    }
+    if(y % TERRAIN_CHUNK_CELLS)
+    {
+        jitterY = dev*(2*RandomHashUnilateral(shape->seed, x, y, 1)-1);
+    }
+    return vec3(TERRAIN_TILE_SIZE*(x+jitterX), TERRAIN_TILE_SIZE*(y+jitterY), z);
+}
+
+// From the full resolution neighbours, so all levels of detail and
+// neighbouring chunks agree on the shading
+internal Vec3
+GetTerrainNormal(TerrainShape *shape, TerrainHeights *heights, int x, int y)
+{
+    int x0 = x > 0 ? x-1 : x;
+    int x1 = x < shape->nCellsX ? x+1 : x;
+    int y0 = y > 0 ? y-1 : y;
+    int y1 = y < shape->nCellsY ? y+1 : y;
+    Vec3 dx = v3_sub(GetTerrainPoint(shape, heights, x1, y), GetTerrainPoint(shape, heights, x0, y));
+    Vec3 dy = v3_sub(GetTerrainPoint(shape, heights, x, y1), GetTerrainPoint(shape, heights, x, y0));
+    return v3_norm(v3_cross(dx, dy));
+}
+
+// Every chunk and level of detail reads its heights from here, the noise is
+// evaluated once per grid point.
+internal void
+FillTerrainHeights(TerrainShape *shape, TerrainHeights *heights, TerrainChunk *chunk)
+{
+    int lastX = chunk->cellX+chunk->nCellsX < shape->nCellsX ? chunk->cellX+chunk->nCellsX+1 : shape->nCellsX;
+    int lastY = chunk->cellY+chunk->nCellsY < shape->nCellsY ? chunk->cellY+chunk->nCellsY+1 : shape->nCellsY;
+    heights->firstX = chunk->cellX > 0 ? chunk->cellX-1 : 0;
+    heights->firstY = chunk->cellY > 0 ? chunk->cellY-1 : 0;
+    heights->width = lastX-heights->firstX+1;
+    for(int y = heights->firstY; y <= lastY; y++)
+    {
+        r32 *row = heights->heights + (y-heights->firstY)*heights->width;
+        perlin2d_row(row, heights->width, heights->firstX, y, 1, 7);
+        for(int x = 0; x < heights->width; x++)
+        {
+            row[x] = TERRAIN_DEPTH*row[x] - TERRAIN_DEPTH;
+        }
+    }
+}
+
+// Grid coordinates of a chunk at a level of detail. Every step-th point,
+// and always the last one so chunk edges line up.
+internal int
+GetChunkLodCoords(int first, int nCells, int step, int *coords)
+{
+    int nCoords = 0;
+    for(int cell = 0;
+            cell < nCells;
+            cell+=step)
+    {
+        coords[nCoords++] = first+cell;
+    }
+    coords[nCoords++] = first+nCells;
+    return nCoords;
+}
+
+// Upper bound of vertices and indices for a chunk of nPoints by nPoints,
+// flat or smooth, with skirts
+internal int
+GetChunkMeshSize(int nPoints)
+{
+    int nCells = nPoints-1;
+    return nPoints*nPoints + nCells*nCells*6 + 4*nCells*16 + 1;
+}
+
+// Vertical strip hanging down from the edge from a to b, seen from both sides
+internal void
+PushTerrainSkirt(Mesh *mesh, Vec3 a, Vec3 b, Vec3 normalA, Vec3 normalB)
+{
+    ui32 first = mesh->nVertices;
+    PushVertex(mesh, a, normalA);
+    PushVertex(mesh, b, normalB);
+    PushVertex(mesh, v3_sub(b, vec3(0, 0, TERRAIN_SKIRT_DEPTH)), normalB);
+    PushVertex(mesh, v3_sub(a, vec3(0, 0, TERRAIN_SKIRT_DEPTH)), normalA);
+    PushIndex(mesh, first);
+    PushIndex(mesh, first+1);
+    PushIndex(mesh, first+2);
+    PushIndex(mesh, first+2);
+    PushIndex(mesh, first+3);
+    PushIndex(mesh, first);
+    PushIndex(mesh, first);
+    PushIndex(mesh, first+2);
+    PushIndex(mesh, first+1);
+    PushIndex(mesh, first+2);
+    PushIndex(mesh, first);
+    PushIndex(mesh, first+3);
+}
+
+internal void
+PushTerrainChunk(TerrainShape *shape, TerrainHeights *heights, Mesh *mesh, TerrainChunk *chunk, int lod)
+{
+    int step = 1 << lod;
+    int xCoords[TERRAIN_CHUNK_CELLS+1];
+    int yCoords[TERRAIN_CHUNK_CELLS+1];
+    int nX = GetChunkLodCoords(chunk->cellX, chunk->nCellsX, step, xCoords);
+    int nY = GetChunkLodCoords(chunk->cellY, chunk->nCellsY, step, yCoords);
+    Vec3 points[(TERRAIN_CHUNK_CELLS+1)*(TERRAIN_CHUNK_CELLS+1)];
+    Vec3 normals[(TERRAIN_CHUNK_CELLS+1)*(TERRAIN_CHUNK_CELLS+1)];
+    for(int y = 0; y < nY; y++)
+    for(int x = 0; x < nX; x++)
+    {
+        points[x+y*nX] = GetTerrainPoint(shape, heights, xCoords[x], yCoords[y]);
+        normals[x+y*nX] = GetTerrainNormal(shape, heights, xCoords[x], yCoords[y]);
+    }
+
+    mesh->colorState = ARGBToVec3(0xfffffb87);
+    if(shape->shading==HEIGHTFIELD_FLAT)
+    {
+        for(int y = 0; y < nY-1; y++)
+        for(int x = 0; x < nX-1; x++)
+        {
+            Vec3 p0 = points[x+y*nX];
+            Vec3 p1 = points[x+1+y*nX];
+            Vec3 p2 = points[x+1+(y+1)*nX];
+            Vec3 p3 = points[x+(y+1)*nX];
+            PushTriangle(mesh, p0, p1, p2);
+            PushTriangle(mesh, p2, p3, p0);
+        }
+    }
+    else
+    {
+        ui32 firstVertex = mesh->nVertices;
+        for(int pointIdx = 0;
+                pointIdx < nX*nY;
+                pointIdx++)
+        {
+            PushVertex(mesh, points[pointIdx], normals[pointIdx]);
+        }
+        for(int y = 0; y < nY-1; y++)
+        for(int x = 0; x < nX-1; x++)
+        {
+            ui32 i0 = firstVertex+x+y*nX;
+            ui32 i2 = i0+1+nX;
+            PushIndex(mesh, i0);
+            PushIndex(mesh, i0+1);
+            PushIndex(mesh, i2);
+            PushIndex(mesh, i2);
+            PushIndex(mesh, i0+nX);
+            PushIndex(mesh, i0);
+        }
+    }
+
+    // Skirts along the four edges
+    for(int x = 0; x < nX-1; x++)
+    {
+        int bottom = x;
+        int top = x+(nY-1)*nX;
+        PushTerrainSkirt(mesh, points[bottom], points[bottom+1], normals[bottom], normals[bottom+1]);
+        PushTerrainSkirt(mesh, points[top], points[top+1], normals[top], normals[top+1]);
+    }
+    for(int y = 0; y < nY-1; y++)
+    {
+        int left = y*nX;
+        int right = nX-1+y*nX;
+        PushTerrainSkirt(mesh, points[left], points[left+nX], normals[left], normals[left+nX]);
+        PushTerrainSkirt(mesh, points[right], points[right+nX], normals[right], normals[right+nX]);
+    }
+}
+
+// The full detail has every point, and skirts only go down
+internal void
+SetTerrainChunkBounds(TerrainShape *shape, TerrainHeights *heights, TerrainChunk *chunk)
+{
+    chunk->boundsMin = GetTerrainPoint(shape, heights, chunk->cellX, chunk->cellY);
+    chunk->boundsMax = chunk->boundsMin;
+    for(int y = 0; y <= chunk->nCellsY; y++)
+    for(int x = 0; x <= chunk->nCellsX; x++)
+    {
+        Vec3 point = GetTerrainPoint(shape, heights, chunk->cellX+x, chunk->cellY+y);
+        if(point.x < chunk->boundsMin.x) chunk->boundsMin.x = point.x;
+        if(point.y < chunk->boundsMin.y) chunk->boundsMin.y = point.y;
+        if(point.z < chunk->boundsMin.z) chunk->boundsMin.z = point.z;
+        if(point.x > chunk->boundsMax.x) chunk->boundsMax.x = point.x;
+        if(point.y > chunk->boundsMax.y) chunk->boundsMax.y = point.y;
+        if(point.z > chunk->boundsMax.z) chunk->boundsMax.z = point.z;
+    }
+    chunk->boundsMin.z-=TERRAIN_SKIRT_DEPTH;
+}
+
+// Largest a chunk can be in the cache file
+internal size_t
+GetTerrainCacheChunkSize()
+{
+    size_t result = sizeof(TerrainCacheChunk);
+    for(int lod = 0;
+            lod < TERRAIN_LOD_COUNT;
+            lod++)
+    {
+        int maxSize = GetChunkMeshSize(TERRAIN_CHUNK_CELLS/(1 << lod) + 2);
+        result+=maxSize*sizeof(PackedVertex) + ((maxSize*sizeof(ui16)+3) & ~3);
+    }
+    return result;
+}
+
+internal void
+CloseTerrainCache(TerrainCache *cache)
+{
+#if !defined(_WIN32)
+    if(cache->file >= 0)
+    {
+        munmap(cache->map, cache->mapSize);
+        close(cache->file);
+    }
+#endif
+    cache->file = -1;
+    cache->map = NULL;
+}
+
+// Opens the cache file of a shape, or starts a new one when the file is
+// missing or written by another version. Without a usable file every chunk
+// is generated.
+internal void
+OpenTerrainCache(TerrainCache *cache, const char *directory, TerrainShape *shape, int nChunks)
+{
+    CloseTerrainCache(cache);
+    TerrainCacheHeader header = {};
+    header.magic = TERRAIN_CACHE_MAGIC;
+    header.version = TERRAIN_CACHE_VERSION;
+    header.seed = shape->seed;
+    header.tileSize = TERRAIN_TILE_SIZE;
+    header.chunkCells = TERRAIN_CHUNK_CELLS;
+    header.lodCount = TERRAIN_LOD_COUNT;
+    header.nCellsX = shape->nCellsX;
+    header.nCellsY = shape->nCellsY;
+    header.shading = shape->shading;
+    header.vertexSize = sizeof(PackedVertex);
+    cache->header = header;
+#if !defined(_WIN32)
+    char path[512];
+    snprintf(path, sizeof(path), "%s/ground_%llx_%dx%d_%s.cache", directory, shape->seed, 
+            shape->nCellsX, shape->nCellsY, shape->shading==HEIGHTFIELD_FLAT ? "flat" : "smooth");
+    cache->file = open(path, O_RDWR | O_CREAT, 0644);
+    if(cache->file < 0)
+    {
+        DebugOut("Can't open ground cache %s", path);
+        return;
+    }
+    size_t tableSize = nChunks*sizeof(ui64);
+    TerrainCacheHeader fileHeader = {};
+    if(pread(cache->file, &fileHeader, sizeof(fileHeader), 0)!=sizeof(fileHeader) || 
+            memcmp(&fileHeader, &header, sizeof(header)) || 
+            pread(cache->file, cache->chunkOffsets, tableSize, sizeof(header))!=(ssize_t)tableSize)
+    {
+        memset(cache->chunkOffsets, 0, tableSize);
+        if(ftruncate(cache->file, 0) || 
+                pwrite(cache->file, &header, sizeof(header), 0)!=sizeof(header) || 
+                ftruncate(cache->file, sizeof(header)+tableSize))
+        {
+            DebugOut("Can't write ground cache %s", path);
+            close(cache->file);
+            cache->file = -1;
+            return;
+        }
+    }
+    cache->fileSize = lseek(cache->file, 0, SEEK_END);
+    cache->mapSize = sizeof(header) + tableSize + nChunks*GetTerrainCacheChunkSize();
+    cache->map = (ui8 *)mmap(NULL, cache->mapSize, PROT_READ, MAP_SHARED, cache->file, 0);
+    if(cache->map==MAP_FAILED)
+    {
+        DebugOut("Can't map ground cache %s", path);
+        close(cache->file);
+        cache->file = -1;
+        cache->map = NULL;
+    }
+#endif
+}
+
+// Points the slot at the chunk in the mapped file, if it is there and looks
+// whole. Appends that never made it into the table can leave the file longer
+// than the mapping, only the mapped part is read.
+internal b32
+ReadTerrainCacheChunk(TerrainCache *cache, TerrainBuildSlot *slot)
+{
+    if(cache->file < 0 || !cache->chunkOffsets[slot->chunkIdx])
+    {
+        return 0;
+    }
+    ui64 offset = cache->chunkOffsets[slot->chunkIdx];
+    ui64 readable = cache->fileSize < cache->mapSize ? cache->fileSize : cache->mapSize;
+    if(offset+sizeof(TerrainCacheChunk) > readable)
+    {
+        return 0;
+    }
+    TerrainCacheChunk *cached = (TerrainCacheChunk *)(cache->map+offset);
+    ui8 *at = (ui8 *)(cached+1);
+    for(int lod = 0;
+            lod < TERRAIN_LOD_COUNT;
+            lod++)
+    {
+        ui32 maxSize = GetChunkMeshSize(TERRAIN_CHUNK_CELLS/(1 << lod) + 2);
+        if(cached->nVertices[lod] > maxSize || cached->nIndices[lod] > maxSize)
+        {
+            return 0;
+        }
+        slot->nVertices[lod] = cached->nVertices[lod];
+        slot->nIndices[lod] = cached->nIndices[lod];
+        slot->vertexData[lod] = at;
+        at+=cached->nVertices[lod]*sizeof(PackedVertex);
+        slot->indexData[lod] = (ui16 *)at;
+        at+=(cached->nIndices[lod]*sizeof(ui16)+3) & ~3;
+    }
+    if(at > cache->map+readable)
+    {
+        return 0;
+    }
+    slot->chunk.boundsMin = cached->boundsMin;
+    slot->chunk.boundsMax = cached->boundsMax;
+    return 1;
+}
+
+// Appends the built chunk, then points the table at it. A chunk that fails
+// to write, or that might not fit in the mapping, is generated again next
+// time.
+internal void
+WriteTerrainCacheChunk(TerrainCache *cache, TerrainBuildSlot *slot)
+{
+#if !defined(_WIN32)
+    if(cache->file < 0 || cache->fileSize+GetTerrainCacheChunkSize() > cache->mapSize)
+    {
+        return;
+    }
+    TerrainCacheChunk cached = {};
+    cached.boundsMin = slot->chunk.boundsMin;
+    cached.boundsMax = slot->chunk.boundsMax;
+    for(int lod = 0;
+            lod < TERRAIN_LOD_COUNT;
+            lod++)
+    {
+        cached.nVertices[lod] = slot->nVertices[lod];
+        cached.nIndices[lod] = slot->nIndices[lod];
+    }
+    ui64 offset = cache->fileSize;
+    ui64 at = offset;
+    b32 written = pwrite(cache->file, &cached, sizeof(cached), at)==sizeof(cached);
+    at+=sizeof(cached);
+    for(int lod = 0;
+            lod < TERRAIN_LOD_COUNT && written;
+            lod++)
+    {
+        size_t vertexSize = slot->nVertices[lod]*sizeof(PackedVertex);
+        size_t indexSize = (slot->nIndices[lod]*sizeof(ui16)+3) & ~3;
+        written = pwrite(cache->file, slot->vertexData[lod], vertexSize, at)==(ssize_t)vertexSize && 
+            pwrite(cache->file, slot->indexData[lod], indexSize, at+vertexSize)==(ssize_t)indexSize;
+        at+=vertexSize+indexSize;
+    }
+    if(written && 
+            pwrite(cache->file, &offset, sizeof(offset), 
+                sizeof(TerrainCacheHeader)+slot->chunkIdx*sizeof(ui64))==sizeof(offset))
+    {
+        cache->chunkOffsets[slot->chunkIdx] = offset;
+        cache->fileSize = at;
+    }
+#endif
+}
+
+// Runs on the build thread, only touches the slot and the cache.
+internal void
+BuildTerrainSlot(TerrainCache *cache, TerrainBuildSlot *slot)
+{
+    if(ReadTerrainCacheChunk(cache, slot))
+    {
+        return;
+    }
+    FillTerrainHeights(&slot->shape, &slot->heights, &slot->chunk);
+    for(int lod = 0;
+            lod < TERRAIN_LOD_COUNT;
+            lod++)
+    {
+        Mesh *mesh = slot->meshes[lod];
+        ClearMesh(mesh);
+        PushTerrainChunk(&slot->shape, &slot->heights, mesh, &slot->chunk, lod);
+        Assert(mesh->nVertices <= 0x10000);
+        for(int indexIdx = 0;
+                indexIdx < mesh->nIndices;
+                indexIdx++)
+        {
+            slot->shortIndices[lod][indexIdx] = (ui16)mesh->indices[indexIdx];
+        }
+        slot->vertexData[lod] = mesh->interleaved;
+        slot->indexData[lod] = slot->shortIndices[lod];
+        slot->nVertices[lod] = mesh->nVertices;
+        slot->nIndices[lod] = mesh->nIndices;
+    }
+    SetTerrainChunkBounds(&slot->shape, &slot->heights, &slot->chunk);
+    WriteTerrainCacheChunk(cache, slot);
+}
+
+// Oldest queued slot, call with the mutex held
+internal TerrainBuildSlot *
+GetQueuedTerrainSlot(Terrain *terrain)
+{
+    TerrainBuildSlot *result = NULL;
+    for(int slotIdx = 0;
+            slotIdx < TERRAIN_BUILD_SLOTS;
+            slotIdx++)
+    {
+        TerrainBuildSlot *slot = terrain->slots+slotIdx;
+        if(slot->state==TERRAIN_SLOT_QUEUED && (!result || slot->ticket < result->ticket))
+        {
+            result = slot;
+        }
+    }
+    return result;
+}
+
+internal void *
+TerrainThreadProc(void *data)
+{
+    Terrain *terrain = (Terrain *)data;
+    pthread_mutex_lock(&terrain->mutex);
+    for(;;)
+    {
+        TerrainBuildSlot *slot = GetQueuedTerrainSlot(terrain);
+        while(!terrain->quit && !slot)
+        {
+            pthread_cond_wait(&terrain->wakeUp, &terrain->mutex);
+            slot = GetQueuedTerrainSlot(terrain);
+        }
+        if(terrain->quit)
+        {
+            break;
+        }
+        slot->state = TERRAIN_SLOT_BUILDING;
+        pthread_mutex_unlock(&terrain->mutex);
+        if(terrain->cacheDirectory && (!terrain->cache.header.magic || 
+                    terrain->cache.header.seed!=slot->shape.seed))
+        {
+            // The world was reset, chunks of older generations are thrown
+            // away unread so the old mapping can go
+            OpenTerrainCache(&terrain->cache, terrain->cacheDirectory, &slot->shape, 
+                    terrain->nChunksX*terrain->nChunksY);
+        }
+        BuildTerrainSlot(&terrain->cache, slot);
+        pthread_mutex_lock(&terrain->mutex);
+        slot->state = TERRAIN_SLOT_DONE;
+    }
+    pthread_mutex_unlock(&terrain->mutex);
+    return NULL;
+}
+
+// Chunks for a width by height world and the build thread. Nothing is built
+// until ResetTerrain and UpdateTerrain.
+internal void
+InitTerrain(MemoryArena *arena, Terrain *terrain, r32 width, r32 height, HeightFieldShading shading, 
+        const char *cacheDirectory)
+{
+    terrain->shape.seed = 0;
+    terrain->shape.shading = shading;
+    terrain->shape.nCellsX = (int)(width/TERRAIN_TILE_SIZE);
+    terrain->shape.nCellsY = (int)(height/TERRAIN_TILE_SIZE);
+    terrain->generation = 0;
+    terrain->nChunksX = (terrain->shape.nCellsX+TERRAIN_CHUNK_CELLS-1)/TERRAIN_CHUNK_CELLS;
+    terrain->nChunksY = (terrain->shape.nCellsY+TERRAIN_CHUNK_CELLS-1)/TERRAIN_CHUNK_CELLS;
+    terrain->chunks = PushArray(arena, TerrainChunk, terrain->nChunksX*terrain->nChunksY);
+    terrain->chunksDrawn = 0;
+    terrain->chunksCulled = 0;
+    for(int chunkY = 0;
+            chunkY < terrain->nChunksY;
+            chunkY++)
+    {
+        for(int chunkX = 0;
+                chunkX < terrain->nChunksX;
+                chunkX++)
+        {
+            TerrainChunk *chunk = terrain->chunks + chunkX + chunkY*terrain->nChunksX;
+            chunk->cellX = chunkX*TERRAIN_CHUNK_CELLS;
+            chunk->cellY = chunkY*TERRAIN_CHUNK_CELLS;
+            chunk->nCellsX = terrain->shape.nCellsX-chunk->cellX;
+            chunk->nCellsY = terrain->shape.nCellsY-chunk->cellY;
+            if(chunk->nCellsX > TERRAIN_CHUNK_CELLS) chunk->nCellsX = TERRAIN_CHUNK_CELLS;
+            if(chunk->nCellsY > TERRAIN_CHUNK_CELLS) chunk->nCellsY = TERRAIN_CHUNK_CELLS;
+            chunk->state = TERRAIN_CHUNK_EMPTY;
+            chunk->resident = -1;
+        }
+    }
+
+    terrain->nResident = 0;
+    terrain->residentModels = PushArray(arena, Model, TERRAIN_MAX_RESIDENT*TERRAIN_LOD_COUNT);
+    for(int resident = 0;
+            resident < TERRAIN_MAX_RESIDENT;
+            resident++)
+    {
+        for(int lod = 0;
+                lod < TERRAIN_LOD_COUNT;
+                lod++)
+        {
+            int nPoints = TERRAIN_CHUNK_CELLS/(1 << lod) + 2;
+            InitDataModel(terrain->residentModels + resident*TERRAIN_LOD_COUNT + lod, 
+                    GetChunkMeshSize(nPoints), VERTEX_FORMAT_PACKED);
+        }
+    }
+
+    terrain->nextTicket = 0;
+    for(int slotIdx = 0;
+            slotIdx < TERRAIN_BUILD_SLOTS;
+            slotIdx++)
+    {
+        TerrainBuildSlot *slot = terrain->slots+slotIdx;
+        slot->state = TERRAIN_SLOT_FREE;
+        for(int lod = 0;
+                lod < TERRAIN_LOD_COUNT;
+                lod++)
+        {
+            int nPoints = TERRAIN_CHUNK_CELLS/(1 << lod) + 2;
+            slot->meshes[lod] = CreateInterleavedMesh(arena, GetChunkMeshSize(nPoints), 
+                    VERTEX_FORMAT_PACKED);
+            slot->shortIndices[lod] = PushArray(arena, ui16, GetChunkMeshSize(nPoints));
+        }
+    }
+
+    terrain->cacheDirectory = cacheDirectory;
+    terrain->cache.header.magic = 0;
+    terrain->cache.file = -1;
+    terrain->cache.map = NULL;
+    terrain->cache.chunkOffsets = PushArray(arena, ui64, terrain->nChunksX*terrain->nChunksY);
+    terrain->quit = 0;
+    pthread_mutex_init(&terrain->mutex, NULL);
+    pthread_cond_init(&terrain->wakeUp, NULL);
+    pthread_create(&terrain->thread, NULL, TerrainThreadProc, terrain);
+}
+
+internal void
+DestroyTerrain(Terrain *terrain)
+{
+    pthread_mutex_lock(&terrain->mutex);
+    terrain->quit = 1;
+    pthread_cond_broadcast(&terrain->wakeUp);
+    pthread_mutex_unlock(&terrain->mutex);
+    pthread_join(terrain->thread, NULL);
+    CloseTerrainCache(&terrain->cache);
+    pthread_mutex_destroy(&terrain->mutex);
+    pthread_cond_destroy(&terrain->wakeUp);
+}
+
+// Drops every chunk, the new ground streams in over the next frames. Does
+// not wait for the build thread, a chunk it is still building is thrown
+// away when it arrives.
+internal void
+ResetTerrain(Terrain *terrain, ui64 seed)
+{
+    pthread_mutex_lock(&terrain->mutex);
+    terrain->generation++;
+    for(int slotIdx = 0;
+            slotIdx < TERRAIN_BUILD_SLOTS;
+            slotIdx++)
+    {
+        if(terrain->slots[slotIdx].state==TERRAIN_SLOT_QUEUED)
+        {
+            terrain->slots[slotIdx].state = TERRAIN_SLOT_FREE;
+        }
+    }
+    pthread_mutex_unlock(&terrain->mutex);
+
+    terrain->shape.seed = seed;
+    for(int chunkIdx = 0;
+            chunkIdx < terrain->nChunksX*terrain->nChunksY;
+            chunkIdx++)
+    {
+        terrain->chunks[chunkIdx].state = TERRAIN_CHUNK_EMPTY;
+        terrain->chunks[chunkIdx].resident = -1;
+    }
+    terrain->nResident = 0;
+}
+
+// Distance in the ground plane from the focus to the cells of the chunk
+internal r32
+GetTerrainChunkDistance(TerrainChunk *chunk, Vec3 focus)
+{
+    r32 minX = chunk->cellX*TERRAIN_TILE_SIZE;
+    r32 minY = chunk->cellY*TERRAIN_TILE_SIZE;
+    r32 dx = fmaxf(fmaxf(minX-focus.x, focus.x-(minX+chunk->nCellsX*TERRAIN_TILE_SIZE)), 0);
+    r32 dy = fmaxf(fmaxf(minY-focus.y, focus.y-(minY+chunk->nCellsY*TERRAIN_TILE_SIZE)), 0);
+    return sqrtf(dx*dx + dy*dy);
+}
+
+// Resident chunk furthest from the focus, -1 if there are none
+internal int
+GetFurthestResident(Terrain *terrain, Vec3 focus, r32 *distance)
+{
+    int result = -1;
+    *distance = 0;
+    for(int resident = 0;
+            resident < terrain->nResident;
+            resident++)
+    {
+        r32 residentDistance = GetTerrainChunkDistance(
+                terrain->chunks+terrain->residentChunks[resident], focus);
+        if(result==-1 || residentDistance > *distance)
+        {
+            result = resident;
+            *distance = residentDistance;
+        }
+    }
+    return result;
+}
+
+// Uploads finished chunks and queues the nearest missing ones around the
+// focus. Call once per frame on the thread with the gl context.
+internal void
+UpdateTerrain(Terrain *terrain, Vec3 focus)
+{
+    int nUploads = 0;
+    for(int slotIdx = 0;
+            slotIdx < TERRAIN_BUILD_SLOTS;
+            slotIdx++)
+    {
+        TerrainBuildSlot *slot = terrain->slots+slotIdx;
+        pthread_mutex_lock(&terrain->mutex);
+        TerrainSlotState state = slot->state;
+        pthread_mutex_unlock(&terrain->mutex);
+        if(state!=TERRAIN_SLOT_DONE)
+        {
+            continue;
+        }
+        if(slot->generation==terrain->generation)
+        {
+            if(nUploads==TERRAIN_UPLOADS_PER_FRAME)
+            {
+                continue;
+            }
+            TerrainChunk *chunk = terrain->chunks+slot->chunkIdx;
+            r32 distance = GetTerrainChunkDistance(chunk, focus);
+            int resident = -1;
+            if(terrain->nResident < TERRAIN_MAX_RESIDENT)
+            {
+                resident = terrain->nResident++;
+            }
+            else
+            {
+                r32 furthestDistance;
+                int furthest = GetFurthestResident(terrain, focus, &furthestDistance);
+                if(furthestDistance > distance)
+                {
+                    resident = furthest;
+                    TerrainChunk *evicted = terrain->chunks+terrain->residentChunks[resident];
+                    evicted->state = TERRAIN_CHUNK_EMPTY;
+                    evicted->resident = -1;
+                }
+            }
+            if(resident >= 0)
+            {
+                for(int lod = 0;
+                        lod < TERRAIN_LOD_COUNT;
+                        lod++)
+                {
+                    SetModelFromData(terrain->residentModels + resident*TERRAIN_LOD_COUNT + lod, 
+                            slot->vertexData[lod], slot->nVertices[lod], 
+                            slot->indexData[lod], slot->nIndices[lod], 
+                            GL_UNSIGNED_SHORT, GL_STATIC_DRAW);
+                }
+                chunk->boundsMin = slot->chunk.boundsMin;
+                chunk->boundsMax = slot->chunk.boundsMax;
+                chunk->state = TERRAIN_CHUNK_RESIDENT;
+                chunk->resident = resident;
+                terrain->residentChunks[resident] = slot->chunkIdx;
+                nUploads++;
+            }
+            else
+            {
+                // The focus moved away while it was built
+                chunk->state = TERRAIN_CHUNK_EMPTY;
+            }
+        }
+        pthread_mutex_lock(&terrain->mutex);
+        slot->state = TERRAIN_SLOT_FREE;
+        pthread_mutex_unlock(&terrain->mutex);
+    }
+
+    // Only the chunks within reach of the resident limit are searched, so
+    // the cost does not grow with the world
+    r32 furthestDistance = 0;
+    if(terrain->nResident==TERRAIN_MAX_RESIDENT)
+    {
+        GetFurthestResident(terrain, focus, &furthestDistance);
+    }
+    int reach = 5;
+    int focusX = (int)(focus.x/(TERRAIN_TILE_SIZE*TERRAIN_CHUNK_CELLS));
+    int focusY = (int)(focus.y/(TERRAIN_TILE_SIZE*TERRAIN_CHUNK_CELLS));
+    int minX = focusX-reach < 0 ? 0 : focusX-reach;
+    int minY = focusY-reach < 0 ? 0 : focusY-reach;
+    int maxX = focusX+reach >= terrain->nChunksX ? terrain->nChunksX-1 : focusX+reach;
+    int maxY = focusY+reach >= terrain->nChunksY ? terrain->nChunksY-1 : focusY+reach;
+    for(int slotIdx = 0;
+            slotIdx < TERRAIN_BUILD_SLOTS;
+            slotIdx++)
+    {
+        TerrainBuildSlot *slot = terrain->slots+slotIdx;
+        pthread_mutex_lock(&terrain->mutex);
+        TerrainSlotState state = slot->state;
+        pthread_mutex_unlock(&terrain->mutex);
+        if(state!=TERRAIN_SLOT_FREE)
+        {
+            continue;
+        }
+        int nearest = -1;
+        r32 nearestDistance = 0;
+        for(int chunkY = minY; chunkY <= maxY; chunkY++)
+        for(int chunkX = minX; chunkX <= maxX; chunkX++)
+        {
+            int chunkIdx = chunkX + chunkY*terrain->nChunksX;
+            if(terrain->chunks[chunkIdx].state!=TERRAIN_CHUNK_EMPTY)
+            {
+                continue;
+            }
+            r32 distance = GetTerrainChunkDistance(terrain->chunks+chunkIdx, focus);
+            if(nearest==-1 || distance < nearestDistance)
+            {
+                nearest = chunkIdx;
+                nearestDistance = distance;
+            }
+        }
+        if(nearest==-1 || 
+                (terrain->nResident==TERRAIN_MAX_RESIDENT && nearestDistance >= furthestDistance))
+        {
+            break;
+        }
+        TerrainChunk *chunk = terrain->chunks+nearest;
+        chunk->state = TERRAIN_CHUNK_BUILDING;
+        slot->chunkIdx = nearest;
+        slot->chunk = *chunk;
+        slot->shape = terrain->shape;
+        slot->generation = terrain->generation;
+        pthread_mutex_lock(&terrain->mutex);
+        slot->ticket = terrain->nextTicket++;
+        slot->state = TERRAIN_SLOT_QUEUED;
+        pthread_cond_signal(&terrain->wakeUp);
+        pthread_mutex_unlock(&terrain->mutex);
+    }
+}
+
+// Draws the resident chunks in the frustum, the detail drops with the
+// distance from the viewer to the chunk bounds.
+internal void
+RenderTerrain(Terrain *terrain, Frustum *frustum, Vec3 viewerPos)
+{
+    terrain->chunksDrawn = 0;
+    terrain->chunksCulled = 0;
+    for(int resident = 0;
+            resident < terrain->nResident;
+            resident++)
+    {
+        TerrainChunk *chunk = terrain->chunks+terrain->residentChunks[resident];
+        if(!IsBoxInFrustum(frustum, chunk->boundsMin, chunk->boundsMax))
+        {
+            terrain->chunksCulled++;
+            continue;
+        }
+        Vec3 closest = vec3(fminf(fmaxf(viewerPos.x, chunk->boundsMin.x), chunk->boundsMax.x),
+                fminf(fmaxf(viewerPos.y, chunk->boundsMin.y), chunk->boundsMax.y),
+                fminf(fmaxf(viewerPos.z, chunk->boundsMin.z), chunk->boundsMax.z));
+        int lod = (int)(v3_length(v3_sub(viewerPos, closest))/TERRAIN_LOD_DISTANCE);
+        if(lod >= TERRAIN_LOD_COUNT) lod = TERRAIN_LOD_COUNT-1;
+        RenderModel(terrain->residentModels + resident*TERRAIN_LOD_COUNT + lod);
+        terrain->chunksDrawn++;
+    }
+}
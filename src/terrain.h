@@ -0,0 +1,154 @@
+// The ground is a grid of TERRAIN_TILE_SIZE cells, split into square chunks
+// of TERRAIN_CHUNK_CELLS cells. Every chunk has a model per level of detail,
+// level n uses every 2^n-th grid point. Skirts along the chunk edges hide the
+// cracks between chunks of different detail.
+#define TERRAIN_TILE_SIZE 10.0f
+#define TERRAIN_CHUNK_CELLS 16
+#define TERRAIN_LOD_COUNT 3
+#define TERRAIN_DEPTH 4.0f
+#define TERRAIN_SKIRT_DEPTH TERRAIN_DEPTH     // as deep as the terrain, covers any lod gap
+#define TERRAIN_LOD_DISTANCE 200.0f     // detail halves every this many units
+
+// Chunks are built on a background thread, nearest to the focus first, and
+// uploaded by the main thread. Only TERRAIN_MAX_RESIDENT chunks have models,
+// the one furthest from the focus makes room for a nearer one.
+#define TERRAIN_MAX_RESIDENT 64
+#define TERRAIN_BUILD_SLOTS 4
+#define TERRAIN_UPLOADS_PER_FRAME 2
+
+typedef enum
+{
+    TERRAIN_CHUNK_EMPTY,
+    TERRAIN_CHUNK_BUILDING,     // in a build slot
+    TERRAIN_CHUNK_RESIDENT,     // has models
+} TerrainChunkState;
+
+typedef struct
+{
+    int cellX;          // first cell of the chunk in the grid
+    int cellY;
+    int nCellsX;        // less than TERRAIN_CHUNK_CELLS on the far edges
+    int nCellsY;
+    TerrainChunkState state;
+    int resident;       // index of its models when resident
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+} TerrainChunk;
+
+// Everything the shape of the ground depends on. The build thread works on
+// its own copy.
+typedef struct
+{
+    ui64 seed;
+    HeightFieldShading shading;
+    int nCellsX;
+    int nCellsY;
+} TerrainShape;
+
+// Heights of the grid points of a chunk and of the ring around it that the
+// normals use, filled a row at a time with perlin2d_row
+#define TERRAIN_HEIGHTS_SIZE (TERRAIN_CHUNK_CELLS+3)
+typedef struct
+{
+    int firstX;         // grid point of heights[0]
+    int firstY;
+    int width;
+    r32 heights[TERRAIN_HEIGHTS_SIZE*TERRAIN_HEIGHTS_SIZE];
+} TerrainHeights;
+
+typedef enum
+{
+    TERRAIN_SLOT_FREE,
+    TERRAIN_SLOT_QUEUED,        // waiting for the build thread
+    TERRAIN_SLOT_BUILDING,      // owned by the build thread
+    TERRAIN_SLOT_DONE,          // owned by the main thread, ready for upload
+} TerrainSlotState;
+
+typedef struct
+{
+    TerrainSlotState state;
+    ui32 ticket;        // queue order, the build thread takes the oldest
+    ui32 generation;    // results of older generations are thrown away
+    int chunkIdx;
+    TerrainChunk chunk;
+    TerrainShape shape;
+    TerrainHeights heights;
+    Mesh *meshes[TERRAIN_LOD_COUNT];
+    ui16 *shortIndices[TERRAIN_LOD_COUNT];
+
+    // What UpdateTerrain uploads, from the meshes or from the cache
+    void *vertexData[TERRAIN_LOD_COUNT];
+    ui16 *indexData[TERRAIN_LOD_COUNT];
+    ui32 nVertices[TERRAIN_LOD_COUNT];
+    ui32 nIndices[TERRAIN_LOD_COUNT];
+} TerrainBuildSlot;
+
+// Finished chunks are kept in a file per seed and world size, in the exact
+// layout they are uploaded in, and read back through a mapping of the file.
+// Bump TERRAIN_CACHE_VERSION whenever the generated ground changes.
+#define TERRAIN_CACHE_MAGIC 0x43475254     // "TRGC"
+#define TERRAIN_CACHE_VERSION 1
+typedef struct
+{
+    ui32 magic;
+    ui32 version;
+    ui64 seed;
+    r32 tileSize;
+    i32 chunkCells;
+    i32 lodCount;
+    i32 nCellsX;
+    i32 nCellsY;
+    i32 shading;
+    i32 vertexSize;
+    i32 padding;
+} TerrainCacheHeader;
+// The header is followed by a ui64 file offset per chunk, 0 for chunks that
+// are not in the file yet. Chunks are appended in the order they are built.
+
+// A chunk in the file, followed per level of detail by its PackedVertex
+// vertices and its 16 bit indices, padded to 4 bytes
+typedef struct
+{
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+    ui32 nVertices[TERRAIN_LOD_COUNT];
+    ui32 nIndices[TERRAIN_LOD_COUNT];
+} TerrainCacheChunk;
+
+// Only used by the build thread. The mapping covers the largest the file can
+// grow, chunks appended later are read through it too.
+typedef struct
+{
+    TerrainCacheHeader header;  // key of the open file
+    int file;                   // -1 when there is no cache
+    ui8 *map;
+    size_t mapSize;
+    ui64 fileSize;
+    ui64 *chunkOffsets;
+} TerrainCache;
+
+typedef struct
+{
+    TerrainShape shape;
+    ui32 generation;    // bumped by ResetTerrain
+    int nChunksX;
+    int nChunksY;
+    TerrainChunk *chunks;
+
+    int nResident;
+    int residentChunks[TERRAIN_MAX_RESIDENT];
+    Model *residentModels;  // TERRAIN_LOD_COUNT per resident chunk
+
+    TerrainBuildSlot slots[TERRAIN_BUILD_SLOTS];
+    ui32 nextTicket;
+    const char *cacheDirectory;     // NULL to always generate
+    TerrainCache cache;
+    pthread_t thread;
+    pthread_mutex_t mutex;      // guards slot states and quit
+    pthread_cond_t wakeUp;
+    b32 quit;
+
+    // Last RenderTerrain
+    int chunksDrawn;
+    int chunksCulled;
+} Terrain;
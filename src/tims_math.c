@@ -0,0 +1,137 @@
+// pi/2 in three parts, the first two with few enough bits that k times them
+// is exact for the k of any angle up to SINCOS_MAX_ANGLE (Cody and Waite)
+#define SINCOS_PI_2_A 1.5703125f
+#define SINCOS_PI_2_B 4.837512969970703125e-4f
+#define SINCOS_PI_2_C 7.54978995489188216e-8f
+#define SINCOS_2_PI 0.636619772367581343f
+#define SINCOS_ROUND 12582912.0f   // 1.5*2^23, adding it rounds to the nearest integer
+
+// Minimax polynomials on [-pi/4, pi/4], the coefficients of the cephes sinf
+// and cosf
+#define SINCOS_S1 -1.6666654611e-1f
+#define SINCOS_S2 8.3321608736e-3f
+#define SINCOS_S3 -1.9515295891e-4f
+#define SINCOS_C1 4.166664568298827e-2f
+#define SINCOS_C2 -1.388731625493765e-3f
+#define SINCOS_C3 2.443315711809948e-5f
+
+internal inline void
+SinCos(r32 angle, r32 *sinResult, r32 *cosResult)
+{
+    if(!(fabsf(angle) <= SINCOS_MAX_ANGLE))
+    {
+        *sinResult = sinf(angle);
+        *cosResult = cosf(angle);
+        return;
+    }
+    // Nearest multiple of pi/2, ties to even
+    r32 k = (angle*SINCOS_2_PI + SINCOS_ROUND) - SINCOS_ROUND;
+    int quadrant = (int)k;
+    r32 x = ((angle - k*SINCOS_PI_2_A) - k*SINCOS_PI_2_B) - k*SINCOS_PI_2_C;
+    r32 x2 = x*x;
+    r32 sinX = x + x*x2*(SINCOS_S1 + x2*(SINCOS_S2 + x2*SINCOS_S3));
+    r32 cosX = (1.0f - 0.5f*x2) + x2*x2*(SINCOS_C1 + x2*(SINCOS_C2 + x2*SINCOS_C3));
+    // Selects instead of branches, the quadrant of a random angle is random
+    r32 sign = (quadrant & 2) ? -1.0f : 1.0f;
+    *sinResult = sign*((quadrant & 1) ? cosX : sinX);
+    *cosResult = sign*((quadrant & 1) ? -sinX : cosX);
+}
+
+#if defined(__SSE2__)
+// Same operations as SinCos, 4 angles at a time
+internal inline void
+SinCos4(__m128 angle, __m128 *sinResult, __m128 *cosResult)
+{
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 inRange = _mm_cmple_ps(_mm_and_ps(angle, absMask), _mm_set1_ps(SINCOS_MAX_ANGLE));
+    __m128 round = _mm_set1_ps(SINCOS_ROUND);
+    __m128 k = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(angle, _mm_set1_ps(SINCOS_2_PI)), round), round);
+    __m128i quadrant = _mm_cvttps_epi32(k);
+    __m128 x = _mm_sub_ps(angle, _mm_mul_ps(k, _mm_set1_ps(SINCOS_PI_2_A)));
+    x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(SINCOS_PI_2_B)));
+    x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(SINCOS_PI_2_C)));
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 sinPoly = _mm_add_ps(_mm_set1_ps(SINCOS_S2), _mm_mul_ps(x2, _mm_set1_ps(SINCOS_S3)));
+    sinPoly = _mm_add_ps(_mm_set1_ps(SINCOS_S1), _mm_mul_ps(x2, sinPoly));
+    __m128 sinX = _mm_add_ps(x, _mm_mul_ps(_mm_mul_ps(x, x2), sinPoly));
+    __m128 cosPoly = _mm_add_ps(_mm_set1_ps(SINCOS_C2), _mm_mul_ps(x2, _mm_set1_ps(SINCOS_C3)));
+    cosPoly = _mm_add_ps(_mm_set1_ps(SINCOS_C1), _mm_mul_ps(x2, cosPoly));
+    __m128 cosX = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), x2)),
+            _mm_mul_ps(_mm_mul_ps(x2, x2), cosPoly));
+
+    // Odd quadrants swap, cos picks up the sign of the swapped sin
+    __m128i one = _mm_set1_epi32(1);
+    __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, one), one));
+    __m128 signBit = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+    __m128 swappedSin = _mm_or_ps(_mm_and_ps(swap, cosX), _mm_andnot_ps(swap, sinX));
+    __m128 swappedCos = _mm_or_ps(_mm_and_ps(swap, _mm_xor_ps(sinX, signBit)), _mm_andnot_ps(swap, cosX));
+    __m128 sign = _mm_or_ps(_mm_set1_ps(1.0f), 
+            _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(2)), 30)));
+    *sinResult = _mm_mul_ps(sign, swappedSin);
+    *cosResult = _mm_mul_ps(sign, swappedCos);
+
+    if(_mm_movemask_ps(inRange)!=0xf)
+    {
+        r32 angles[4];
+        r32 sins[4];
+        r32 coses[4];
+        _mm_storeu_ps(angles, angle);
+        _mm_storeu_ps(sins, *sinResult);
+        _mm_storeu_ps(coses, *cosResult);
+        for(int lane = 0;
+                lane < 4;
+                lane++)
+        {
+            SinCos(angles[lane], sins+lane, coses+lane);
+        }
+        *sinResult = _mm_loadu_ps(sins);
+        *cosResult = _mm_loadu_ps(coses);
+    }
+}
+#endif
+
+// sins[i] and coses[i] of angles[i] for i in [begin, end). The arrays have to
+// be 16 byte aligned and begin a multiple of 4 for the simd path.
+internal void
+SinCosFill(r32 *angles, int begin, int end, r32 *sins, r32 *coses)
+{
+    int idx = begin;
+#if defined(__SSE2__)
+    for(;
+            idx+4 <= end;
+            idx+=4)
+    {
+        __m128 sin4, cos4;
+        SinCos4(_mm_load_ps(angles+idx), &sin4, &cos4);
+        _mm_store_ps(sins+idx, sin4);
+        _mm_store_ps(coses+idx, cos4);
+    }
+#endif
+    for(;
+            idx < end;
+            idx++)
+    {
+        SinCos(angles[idx], sins+idx, coses+idx);
+    }
+}
+
+// Only call from one thread, the tables are built on first use
+internal Vec2 *
+GetUnitCircle(int nPoints)
+{
+    local_persist UnitCircle circles[UNIT_CIRCLE_MAX_POINTS+1];
+    Assert(nPoints > 1 && nPoints <= UNIT_CIRCLE_MAX_POINTS);
+    UnitCircle *circle = circles+nPoints;
+    if(!circle->isBuilt)
+    {
+        for(int point = 0;
+                point < nPoints;
+                point++)
+        {
+            r32 angle = point * (M_PI*2.0 / (nPoints-1));
+            circle->points[point] = vec2(cosf(angle), sinf(angle));
+        }
+        circle->isBuilt = 1;
+    }
+    return circle->points;
+}
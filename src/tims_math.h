@@ -0,0 +1,15 @@
+// Sine and cosine from a polynomial after reducing the angle to [-pi/4, pi/4].
+// The scalar and simd paths produce the same numbers. Measured against double
+// precision over |angle| <= SINCOS_MAX_ANGLE the error is below 1e-7, under
+// 1 ulp near 1, see --bench-math. Larger angles go to sinf and cosf.
+#define SINCOS_MAX_ANGLE 8192.0f
+
+// Points on the unit circle for PushLineCircle, point i at angle
+// i*2pi/(nPoints-1) so the last point closes the circle. Built on first use
+// for every point count up to UNIT_CIRCLE_MAX_POINTS.
+#define UNIT_CIRCLE_MAX_POINTS 64
+typedef struct
+{
+    b32 isBuilt;
+    Vec2 points[UNIT_CIRCLE_MAX_POINTS];
+} UnitCircle;
@@ -0,0 +1,211 @@
+internal void *
+PushScratch(WorkerScratch *scratch, size_t size)
+{
+    if(scratch->used+size > scratch->size)
+    {
+        size_t newSize = scratch->size ? scratch->size : WORKER_SCRATCH_SIZE;
+        while(newSize < scratch->used+size)
+        {
+            newSize*=2;
+        }
+        scratch->base = (ui8 *)realloc(scratch->base, newSize);
+        Assert(scratch->base);
+        scratch->size = newSize;
+    }
+    scratch->used+=size;
+    return scratch->base + scratch->used - size;
+}
+
+internal inline ui64
+PackTaskRange(ui32 begin, ui32 end)
+{
+    return ((ui64)end << 32) | begin;
+}
+
+internal b32
+TakeOwnTask(WorkerDeque *deque, int *taskIdx)
+{
+    ui64 range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        ui32 begin = (ui32)range;
+        ui32 end = (ui32)(range >> 32);
+        if(begin >= end)
+        {
+            return 0;
+        }
+        if(__atomic_compare_exchange_n(&deque->range, &range, PackTaskRange(begin+1, end), 
+                    1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *taskIdx = begin;
+            return 1;
+        }
+    }
+}
+
+internal b32
+StealTask(WorkerDeque *deque, int *taskIdx)
+{
+    ui64 range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        ui32 begin = (ui32)range;
+        ui32 end = (ui32)(range >> 32);
+        if(begin >= end)
+        {
+            return 0;
+        }
+        if(__atomic_compare_exchange_n(&deque->range, &range, PackTaskRange(begin, end-1), 
+                    1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *taskIdx = end-1;
+            return 1;
+        }
+    }
+}
+
+// Runs tasks until no deque has any left.
+internal void
+DoWork(WorkerPool *pool, int threadIdx)
+{
+    int taskIdx;
+    for(;;)
+    {
+        b32 found = TakeOwnTask(pool->deques+threadIdx, &taskIdx);
+        for(int victimOffset = 1;
+                !found && victimOffset < pool->nThreads;
+                victimOffset++)
+        {
+            int victim = (threadIdx+victimOffset)%pool->nThreads;
+            found = StealTask(pool->deques+victim, &taskIdx);
+        }
+        if(!found)
+        {
+            return;
+        }
+        // Tasks are only handed out after the callback is set, so this is
+        // always the callback of the job the task belongs to.
+        WorkCallback *callback = __atomic_load_n(&pool->callback, __ATOMIC_ACQUIRE);
+        void *data = __atomic_load_n(&pool->data, __ATOMIC_ACQUIRE);
+        callback(data, taskIdx, threadIdx);
+        __atomic_fetch_sub(&pool->nPendingTasks, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+internal void *
+WorkerThreadProc(void *parameter)
+{
+    WorkerThread *worker = (WorkerThread *)parameter;
+    WorkerPool *pool = worker->pool;
+    i32 seenGeneration = 0;
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->generation==seenGeneration && !pool->quit)
+        {
+            pthread_cond_wait(&pool->wakeUp, &pool->mutex);
+        }
+        seenGeneration = pool->generation;
+        b32 quit = pool->quit;
+        pthread_mutex_unlock(&pool->mutex);
+        if(quit)
+        {
+            return NULL;
+        }
+        DoWork(pool, worker->threadIdx);
+    }
+}
+
+// Thread 0 is the calling thread, the others are started here.
+internal WorkerPool *
+CreateWorkerPool(MemoryArena *arena, int nThreads)
+{
+    if(nThreads < 1)
+    {
+        nThreads = 1;
+    }
+    WorkerPool *pool = PushStruct(arena, WorkerPool);
+    pool->nThreads = nThreads;
+    pool->workers = PushArray(arena, WorkerThread, nThreads);
+    pool->threads = PushArray(arena, pthread_t, nThreads);
+    pool->deques = PushAlignedArray(arena, WorkerDeque, nThreads, 64);
+    pool->scratch = PushAlignedArray(arena, WorkerScratch, nThreads, 64);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wakeUp, NULL);
+    for(int threadIdx = 0;
+            threadIdx < nThreads;
+            threadIdx++)
+    {
+        WorkerThread *worker = pool->workers+threadIdx;
+        worker->pool = pool;
+        worker->threadIdx = threadIdx;
+        pool->deques[threadIdx].range = 0;
+        pool->scratch[threadIdx] = (WorkerScratch){};
+        if(threadIdx > 0)
+        {
+            pthread_create(pool->threads+threadIdx, NULL, WorkerThreadProc, worker);
+        }
+    }
+    return pool;
+}
+
+internal void
+DestroyWorkerPool(WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wakeUp);
+    pthread_mutex_unlock(&pool->mutex);
+    for(int threadIdx = 1;
+            threadIdx < pool->nThreads;
+            threadIdx++)
+    {
+        pthread_join(pool->threads[threadIdx], NULL);
+    }
+    for(int threadIdx = 0;
+            threadIdx < pool->nThreads;
+            threadIdx++)
+    {
+        free(pool->scratch[threadIdx].base);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wakeUp);
+}
+
+// Runs callback(data, taskIdx, threadIdx) for every task in [0, nTasks) and returns
+// when all of them are done. The calling thread works along.
+internal void
+RunParallel(WorkerPool *pool, int nTasks, WorkCallback *callback, void *data)
+{
+    if(pool->nThreads==1 || nTasks <= 1)
+    {
+        for(int taskIdx = 0;
+                taskIdx < nTasks;
+                taskIdx++)
+        {
+            callback(data, taskIdx, 0);
+        }
+        return;
+    }
+    __atomic_store_n(&pool->callback, callback, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->data, data, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->nPendingTasks, nTasks, __ATOMIC_RELEASE);
+    for(int threadIdx = 0;
+            threadIdx < pool->nThreads;
+            threadIdx++)
+    {
+        ui32 begin = (ui32)(((i64)nTasks*threadIdx)/pool->nThreads);
+        ui32 end = (ui32)(((i64)nTasks*(threadIdx+1))/pool->nThreads);
+        __atomic_store_n(&pool->deques[threadIdx].range, PackTaskRange(begin, end), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wakeUp);
+    pthread_mutex_unlock(&pool->mutex);
+
+    DoWork(pool, 0);
+    while(__atomic_load_n(&pool->nPendingTasks, __ATOMIC_ACQUIRE) > 0)
+    {
+        sched_yield();
+    }
+}
@@ -0,0 +1,50 @@
+#include <pthread.h>
+#include <sched.h>
+
+// threadIdx is in [0, nThreads) and can be used to index per thread data.
+typedef void WorkCallback(void *data, int taskIdx, int threadIdx);
+
+// Per thread output of tasks. Grows when needed, only the owning thread may
+// push and a push can move the block, so keep offsets rather than pointers.
+#define WORKER_SCRATCH_SIZE (1024*1024)
+typedef struct
+{
+    ui8 *base;
+    size_t used;
+    size_t size;
+    ui8 padding[40];
+} WorkerScratch;
+
+// Each thread owns a contiguous range of task indices. The owner takes from
+// the front and idle threads steal from the back. begin and end are packed
+// in one 64 bit word so both sides update it with a single compare-exchange.
+typedef struct
+{
+    ui64 range;
+    ui8 padding[56];
+} WorkerDeque;
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct
+{
+    WorkerPool *pool;
+    int threadIdx;
+} WorkerThread;
+
+struct WorkerPool
+{
+    int nThreads;               // including the calling thread
+    WorkerThread *workers;
+    pthread_t *threads;
+    WorkerDeque *deques;
+    WorkerScratch *scratch;     // one per thread, tasks may only use their own
+
+    WorkCallback *callback;
+    void *data;
+    i32 nPendingTasks;
+    i32 generation;
+    b32 quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeUp;
+};